@@ -4,6 +4,8 @@
 #include <stdio.h>
 
 #include "6502.h"
+#include "prof.h"
+#include "stats.h"
 
 static void op_ld(cpu_state_t *, uint8_t);
 static void op_adc(cpu_state_t *, uint8_t);
@@ -31,7 +33,7 @@ static void op_br(cpu_state_t *, uint8_t);
 static uint16_t adr_fetch(uint8_t mode, cpu_state_t *cpu);
 
 
-static opc_descr_t opcodes[0xFF] = {
+static opc_descr_t opcodes[0x100] = {
   /* jump/flag */
   [0x18] = {ADR_IMP, op_tog_c, "clc"},
   [0x38] = {ADR_IMP, op_tog_c, "sec"},
@@ -191,14 +193,132 @@ static void cpu_update_ps(cpu_state_t *cpu, uint16_t value, uint8_t bits) {
   cpu->ps = (cpu->ps & ~bits) | (new_ps & bits);
 }
 
+/* edge coverage, AFL style: map[hash(from) ^ hash(to)]++ */
+static uint8_t *cpu_cov_map;
+static uint16_t cov_prev;
+
+#define COV_EDGE(to)                                              \
+  do {                                                            \
+    if (cpu_cov_map) {                                            \
+      uint16_t cur = (uint16_t)((to) * 0x9E37u);                  \
+      cpu_cov_map[(cur ^ cov_prev) & (CPU_COV_SIZE - 1)]++;       \
+      cov_prev = cur >> 1;                                        \
+    }                                                             \
+  } while (0)
+
+void cpu_set_coverage(uint8_t *map) {
+  cpu_cov_map = map;
+  cov_prev = 0;
+}
+
+/* stack bytes pushed (<0) or pulled (>0), to catch wrap-arounds */
+static const int8_t stack_use[0x100] = {
+  [0x48] = -1, [0x08] = -1, [0x20] = -2,  /* pha, php, jsr */
+  [0x68] =  1, [0x28] =  1, [0x60] =  2   /* pla, plp, rts */
+};
+
+/* called instead of executing a jsr, see cpu_set_jsr_hook */
+static jsr_hook_t jsr_hook;
+
+void cpu_set_jsr_hook(jsr_hook_t hook) {
+  jsr_hook = hook;
+}
+
+/* base cycle counts; there's no page crossing penalty or such */
+static const uint8_t mode_cycles[ADR_MAX] = {
+  [ADR_IMP] = 2, [ADR_IMM] = 2, [ADR_ZP]  = 3, [ADR_ZPX] = 4,
+  [ADR_ZPY] = 4, [ADR_ABS] = 4, [ADR_ABX] = 4, [ADR_ABY] = 4,
+  [ADR_IZX] = 6, [ADR_IZY] = 5, [ADR_IND] = 5, [ADR_REL] = 2
+};
+
+/* STOP_NONE if the instruction at pc can execute */
+static int stop_reason(const cpu_state_t *cpu, uint8_t opcode) {
+  if (!opcode)
+    return STOP_BRK;
+
+  if (!opcodes[opcode].cfun)
+    return STOP_ILLEGAL;
+
+  int8_t stack = stack_use[opcode];
+  if (stack && (stack < 0 ? cpu->sp < -stack : cpu->sp > 0xFF - stack))
+    return STOP_STACK;
+
+  return STOP_NONE;
+}
+
 void run_machine(cpu_state_t *cpu) {
+  run_machine_for(cpu, 0, NULL);
+}
+
+/* executes a single instruction, returns STOP_NONE or why it couldn't */
+int step_machine(cpu_state_t *cpu) {
+  uint8_t opcode = cpu->mem[cpu->pc];
+  int reason = stop_reason(cpu, opcode);
+  if (reason == STOP_NONE)
+    opcodes[opcode].cfun(cpu, opcodes[opcode].addr_m);
+
+  return reason;
+}
+
+/* runs until brk, or until max_instrs have executed if it's non-zero.
+ * returns one of STOP_*, the number of instructions executed goes into
+ * executed unless it's NULL */
+int run_machine_for(cpu_state_t *cpu, uint64_t max_instrs,
+                    uint64_t *executed) {
   uint8_t opcode;
-  while ((opcode = cpu->mem[cpu->pc])) {
+  uint32_t instrs = 0, cycles = 0;
+  uint64_t n = 0;
+  int reason = STOP_BRK;
+
+  while (1) {
+    opcode = cpu->mem[cpu->pc];
+    if ((reason = stop_reason(cpu, opcode)) != STOP_NONE)
+      break;
+
     opc_descr_t *op_handler = &opcodes[opcode];
+#ifndef NDEBUG
     printf("exec %s (%x)\n", op_handler->name, opcode);
-    assert(op_handler && "no handler for opcode type");
-    op_handler->cfun(cpu, op_handler->addr_m);
+#endif
+
+    if (n >= max_instrs && max_instrs) {
+      reason = STOP_BUDGET;
+      break;
+    }
+
+    /* a call the hook covered counts its instructions, but only the
+     * cycles of the jsr */
+    uint64_t done = 0;
+    if (opcode == 0x20 && jsr_hook)
+      done = jsr_hook(cpu, max_instrs ? max_instrs - n : 0);
+
+    if (done) {
+      n += done;
+    }
+    else {
+      n++;
+      done = 1;
+      PROF_BEGIN(t0);
+      op_handler->cfun(cpu, op_handler->addr_m);
+      PROF_END(t0, opcode);
+    }
+
+    if (p64_stats) {
+      cycles += instr_cycles(opcode);
+      if ((instrs += done) >= STATS_FLUSH) {
+        stats_update(instrs, cycles);
+        instrs = cycles = 0;
+      }
+    }
   }
+
+  if (p64_stats) {
+    stats_update(instrs, cycles);
+    stats_stop(reason, cpu);
+  }
+
+  if (executed)
+    *executed = n;
+  return reason;
 }
 
 uint16_t adr_fetch(uint8_t mode, cpu_state_t *cpu) {
@@ -221,25 +341,36 @@ uint16_t adr_fetch(uint8_t mode, cpu_state_t *cpu) {
 
     return base;
 
-  case ADR_ZP:
-  case ADR_ZPX:
+  case ADR_IND:
+    /* pointers are stored hi byte first, same as operands */
+    hi = cpu->mem[cpu->pc++];
+    base = (uint16_t)hi << 8 | cpu->mem[cpu->pc++];
+    return (uint16_t)cpu->mem[base] << 8 | cpu->mem[(uint16_t)(base + 1)];
+
+  case ADR_ZP:  return cpu->mem[cpu->pc++];
+  case ADR_ZPX: return (cpu->mem[cpu->pc++] + cpu->x) & 0xFF;
+  case ADR_ZPY: return (cpu->mem[cpu->pc++] + cpu->y) & 0xFF;
+
+  case ADR_IZX:
   case ADR_IZY:
     base = cpu->mem[cpu->pc++];
+    if (mode == ADR_IZX)
+      base = (base + cpu->x) & 0xFF;
 
-    if (mode == ADR_ZPX)
-      base += cpu->x;
-    else if (mode == ADR_IZY)
-      base += cpu->mem[base & 0xFF] + cpu->y;
+    base = (uint16_t)cpu->mem[base] << 8 | cpu->mem[(base + 1) & 0xFF];
+    if (mode == ADR_IZY)
+      base += cpu->y;
 
     return base;
 
   case ADR_REL:
-    base = cpu->pc - 2 + (int16_t)cpu->mem[cpu->pc++];
-    return base;
+    base = (int8_t)cpu->mem[cpu->pc++];
+    return cpu->pc + base;
 
-  case ADR_IZX: assert(!"to be fixed");
   default: assert(!"invalid addressing mode");
   }
+
+  return 0;
 }
 
 void op_ld(cpu_state_t *cpu, uint8_t mode) {
@@ -318,7 +449,7 @@ void op_trans(cpu_state_t *cpu, uint8_t mode) {
   case 0x98: source = &cpu->y;  dest = &cpu->a;  break;
   case 0xBA: source = &cpu->sp; dest = &cpu->x;  break;
   case 0x9A: source = &cpu->x;  dest = &cpu->sp; break;
-  default: assert(!"strange opcode");
+  default: assert(!"strange opcode"); return;
   }
 
   *dest = *source;
@@ -331,7 +462,7 @@ void op_push(cpu_state_t *cpu, uint8_t mode) {
   switch (code) {
   case 0x48: source = &cpu->a; break;
   case 0x08: source = &cpu->ps; break;
-  default: assert(!"invalid opcode");
+  default: assert(!"invalid opcode"); return;
   }
 
   PUSH8(cpu, *source);
@@ -343,7 +474,7 @@ void op_pull(cpu_state_t *cpu, uint8_t mode) {
   switch (code) {
   case 0x68: dest = &cpu->a; break;
   case 0x28: dest = &cpu->ps; break;
-  default: assert(!"invalid opcode");
+  default: assert(!"invalid opcode"); return;
   }
 
   *dest = POP8(cpu);
@@ -388,7 +519,8 @@ void op_nop(cpu_state_t *cpu, uint8_t mode) {
 
 void op_jmp(cpu_state_t *cpu, uint8_t mode) {
   cpu->pc++;
-  cpu->pc = cpu->mem[adr_fetch(mode, cpu)];
+  cpu->pc = adr_fetch(mode, cpu);
+  COV_EDGE(cpu->pc);
 }
 
 void op_rts(cpu_state_t *cpu, uint8_t mode) {
@@ -402,6 +534,7 @@ void op_jsr(cpu_state_t *cpu, uint8_t mode) {
   uint16_t toadr = adr_fetch(mode, cpu);
   PUSH16(cpu, pc);
   cpu->pc = toadr;
+  COV_EDGE(toadr);
 }
 
 void op_ora(cpu_state_t *cpu, uint8_t mode) {
@@ -488,8 +621,11 @@ void op_br(cpu_state_t *cpu, uint8_t mode) {
   default: assert(!"invalid opcode");
   }
 
+  uint16_t target = adr_fetch(mode, cpu);
   if (exec_br)
-    cpu->pc = adr_fetch(mode, cpu);
+    cpu->pc = target;
+
+  COV_EDGE(cpu->pc);
 }
 
 void print_state(cpu_state_t *state) {
@@ -521,26 +657,111 @@ opc_descr_t *instr_descr(uint8_t opc) {
   return &opcodes[opc];
 }
 
-uint8_t instr_named(const char *instr, uint8_t addr_m) {
-  size_t i;
-  for (i = 0; i < 0xFF; ++i) {
-    opc_descr_t *desc = &opcodes[i];
-    if (desc->name && desc->addr_m == addr_m && strcmp(desc->name, instr) == 0)
-      return i;
+uint8_t instr_cycles(uint8_t opc) {
+  switch (opc) {
+  case 0x4C: return 3;              /* jmp abs */
+  case 0x20:                        /* jsr */
+  case 0x60: return 6;              /* rts */
+  case 0x48:                        /* pha */
+  case 0x08: return 3;              /* php */
+  case 0x68:                        /* pla */
+  case 0x28: return 4;              /* plp */
+  case 0xC6: case 0xE6: return 5;   /* dec/inc zp */
+  case 0xD6: case 0xF6:             /* dec/inc zp,x */
+  case 0xCE: case 0xEE: return 6;   /* dec/inc abs */
+  case 0xDE: case 0xFE: return 7;   /* dec/inc abs,x */
   }
 
-  return 0;
+  return mode_cycles[opcodes[opc].addr_m];
 }
 
-uint16_t instr_modes(const char *instr) {
-  /* if needed for speed, create a new sorted table */
-  uint16_t ret = 0;
+/* instruction length in bytes, including the opcode */
+uint8_t instr_len(uint8_t opc) {
+  switch (opcodes[opc].addr_m) {
+  case ADR_IMP: return 1;
+  case ADR_ABS:
+  case ADR_ABX:
+  case ADR_ABY:
+  case ADR_IND: return 3;
+  default:      return 2;
+  }
+}
+
+/* the address the instruction at pc reads or writes, without executing
+ * it. only meaningful for modes that access memory */
+uint16_t instr_adr(cpu_state_t *cpu) {
+  uint16_t pc = cpu->pc;
+  uint8_t mode = opcodes[cpu->mem[pc]].addr_m;
+  uint16_t adr = 0;
+
+  cpu->pc++;
+  if (mode != ADR_IMP)
+    adr = adr_fetch(mode, cpu);
+  cpu->pc = pc;
+
+  return adr;
+}
+
+/*
+ * Mnemonics are three lowercase letters, so they index a 26^3 table
+ * directly. It's filled from opcodes[] before main runs and only read
+ * after that.
+ */
+#define MNEMONIC_SLOTS (26 * 26 * 26)
+
+static instr_set_t instr_sets[0x100];
+static uint8_t mnemonic_index[MNEMONIC_SLOTS];  /* instr_sets index + 1 */
+
+static int mnemonic_slot(const char *instr, size_t len) {
+  if (len != 3 ||
+      instr[0] < 'a' || instr[0] > 'z' ||
+      instr[1] < 'a' || instr[1] > 'z' ||
+      instr[2] < 'a' || instr[2] > 'z')
+    return -1;
+
+  return ((instr[0] - 'a') * 26 + instr[1] - 'a') * 26 + instr[2] - 'a';
+}
+
+__attribute__((constructor))
+static void build_mnemonic_index(void) {
+  size_t num_sets = 0;
   size_t i;
-  for (i = 0; i < 0xFF; ++i) {
+  for (i = 0; i < 0x100; ++i) {
     opc_descr_t *desc = &opcodes[i];
-    if (desc->name && strcmp(desc->name, instr) == 0)
-      ret |= (1 << desc->addr_m);
+    if (!desc->name)
+      continue;
+
+    int slot = mnemonic_slot(desc->name, strlen(desc->name));
+    assert(slot != -1 && "mnemonics are three lowercase letters");
+    if (!mnemonic_index[slot]) {
+      instr_sets[num_sets].name = desc->name;
+      mnemonic_index[slot] = ++num_sets;
+    }
+
+    instr_set_t *set = &instr_sets[mnemonic_index[slot] - 1];
+    set->modes |= 1 << desc->addr_m;
+    set->opcode[desc->addr_m] = i;
   }
+}
 
-  return ret;
+/* instr is len chars, it doesn't have to be terminated */
+const instr_set_t *instr_opcodes(const char *instr, size_t len) {
+  int slot = mnemonic_slot(instr, len);
+  if (slot == -1 || !mnemonic_index[slot])
+    return NULL;
+
+  return &instr_sets[mnemonic_index[slot] - 1];
+}
+
+uint8_t instr_named(const char *instr, uint8_t addr_m) {
+  const instr_set_t *set = instr_opcodes(instr, strlen(instr));
+  if (!set || !(set->modes & (1 << addr_m)))
+    return 0;
+
+  return set->opcode[addr_m];
+}
+
+uint16_t instr_modes(const char *instr) {
+  const instr_set_t *set = instr_opcodes(instr, strlen(instr));
+  return (set ? set->modes : 0);
 }
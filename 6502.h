@@ -2,6 +2,7 @@
 #define P64_6502_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define PS_C 0x01 /* carry */
 #define PS_Z 0x02 /* zero */
@@ -27,6 +28,15 @@
 
 #define MEM_MAX 0xFFFF
 
+/* why run_machine returned */
+#define STOP_NONE    -1  /* still running */
+#define STOP_BRK      0
+#define STOP_BUDGET   1  /* ran out of instructions */
+#define STOP_ILLEGAL  2  /* unknown opcode */
+#define STOP_STACK    3  /* stack over- or underflow */
+
+#define CPU_COV_SIZE  0x4000  /* bytes in a coverage map, power of 2 */
+
 #define PUSH8(cpu, val)  (cpu)->mem[0x100 + (cpu)->sp--] = (val)
 #define PUSH16(cpu, val) (cpu)->mem[0x100 + (cpu)->sp] = (val) & 0xFF;  \
                          (cpu)->mem[0x0FF + (cpu)->sp] = (val) >> 8;    \
@@ -40,22 +50,42 @@
 typedef struct cpu_state {
   uint8_t a, x, y, ps, sp;
   uint16_t pc;
-  uint8_t mem[MEM_MAX];
+  uint8_t mem[MEM_MAX + 1];
 } cpu_state_t;
 
 typedef void (*opcode_fun_t)(cpu_state_t *, uint8_t);
 
+/* runs the jsr at pc in some other way, returns the number of instructions
+ * that covered or 0 to let the interpreter execute it. it mustn't cover
+ * more than budget instructions unless budget is 0 */
+typedef uint64_t (*jsr_hook_t)(cpu_state_t *, uint64_t budget);
+
 typedef struct opc_descr_t {
   uint8_t addr_m;
   opcode_fun_t cfun;
   const char *name;
 } opc_descr_t;
 
+/* every addressing mode of one mnemonic */
+typedef struct instr_set {
+  const char *name;
+  uint16_t modes;             /* 1 << ADR_x for each mode it has */
+  uint8_t opcode[ADR_MAX];    /* by mode, valid where modes has the bit */
+} instr_set_t;
+
 void print_instr(uint8_t *, uint16_t len, uint16_t start_ofs);
 void print_state(cpu_state_t *);
 void run_machine(cpu_state_t *);
+int run_machine_for(cpu_state_t *, uint64_t max_instrs, uint64_t *executed);
+int step_machine(cpu_state_t *);
+void cpu_set_coverage(uint8_t *map);
+void cpu_set_jsr_hook(jsr_hook_t hook);
 opc_descr_t *instr_descr(uint8_t opc);
 uint8_t instr_named(const char *instr, uint8_t addr_m);
 uint16_t instr_modes(const char *instr);
+const instr_set_t *instr_opcodes(const char *instr, size_t len);
+uint8_t instr_cycles(uint8_t opc);
+uint8_t instr_len(uint8_t opc);
+uint16_t instr_adr(cpu_state_t *);
 
 #endif /* !P64_6502_H */
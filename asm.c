@@ -1,165 +1,555 @@
+#define _POSIX_C_SOURCE 200809L
 #include "asm.h"
+#include "opt.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
+#define NAME_CHUNK 0x10000
+
+typedef struct name_chunk {
+  struct name_chunk *prev;
+  char data[];
+} name_chunk_t;
+
 void sym_clear(struct symtab *syms) {
-  size_t i;
-  for (i = 0; i < syms->num_symbols; ++i)
-    free(syms->symbols[i].id);
+  while (syms->names) {
+    name_chunk_t *prev = syms->names->prev;
+    free(syms->names);
+    syms->names = prev;
+  }
 
-  syms->num_symbols = 0;
+  free(syms->symbols);
+  free(syms->slots);
+  free(syms->by_address);
+  free(syms->fixups);
+  free(syms->sections);
+  free(syms->instrs);
+  memset(syms, 0, sizeof *syms);
 }
 
-static sym_def_t *sym_lookup(struct symtab *syms, const char *name) {
-  size_t i;
-  for (i = 0; i < syms->num_symbols; ++i) {
-    if (strcmp(syms->symbols[i].id, name) == 0)
-      return &syms->symbols[i];
-  }
-
-  return NULL;
-}
-
-
-/* prints the instructions at start_ofs, up to len bytes */
-void print_instr(uint8_t *mem, uint16_t len, uint16_t start_ofs) {
-  uint16_t end = len + start_ofs;
-  uint16_t pc = start_ofs;
-  
-  while (pc < end) {
-    uint16_t instr_pc = pc;
-    uint8_t code = mem[pc++];
-    opc_descr_t *opcode = instr_descr(code);
-    char instr[64] = {0};
-    char prefix[64] = {0};
-    size_t num_bytes = 1;
-    const char *fmt = "";
-    
-    sprintf(prefix, ".%04X  ", instr_pc);
-
-    if (opcode->cfun) {
-      switch (opcode->addr_m) {
-      /* 3 byte instructions */
-      case ADR_ABX:   fmt =            "%s $%04X,X";
-      case ADR_ABY:   if (!*fmt) fmt = "%s $%04X,Y";
-      case ADR_ABS:   if (!*fmt) fmt = "%s $%04X";
-      case ADR_IND:   if (!*fmt) fmt = "%s ($%04X)";
-      case ADR_REL:   if (!*fmt) fmt = "%s $%04X,PC";
-        num_bytes = 3;
-        uint8_t hi = mem[pc++];
-        uint16_t val = (uint16_t)hi << 8 | mem[pc++];
-        sprintf(instr, fmt, opcode->name, val);
-        break;
+/* copies name into the arena, terminated. chunks are filled from the end */
+static char *sym_intern(struct symtab *syms, const char *name, size_t len) {
+  if (len + 1 > syms->names_left) {
+    size_t size = (len + 1 > NAME_CHUNK ? len + 1 : NAME_CHUNK);
+    name_chunk_t *chunk = malloc(sizeof *chunk + size);
+    chunk->prev = syms->names;
+    syms->names = chunk;
+    syms->names_left = size;
+  }
+
+  syms->names_left -= len + 1;
+  char *id = syms->names->data + syms->names_left;
+  memcpy(id, name, len);
+  id[len] = '\0';
+  return id;
+}
+
+static uint32_t sym_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  while (len--)
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+
+  return h;
+}
 
-      /* 2 byte instructions */
-      case ADR_IMM:   fmt =            "%s #$%02X";
-      case ADR_ZPX:   if (!*fmt) fmt = "%s $%02X,X";
-      case ADR_ZPY:   if (!*fmt) fmt = "%s $%02X,Y";
-      case ADR_ZP:    if (!*fmt) fmt = "%s $%02X";
-      case ADR_IZX:   if (!*fmt) fmt = "%s ($%02X,X)";
-      case ADR_IZY:   if (!*fmt) fmt = "%s ($%02X),Y";
-        val = mem[pc++];
-        num_bytes = 2;
-        sprintf(instr, fmt, opcode->name, val);
+/* the slot holding name, or the empty slot where it would go */
+static sym_slot_t *sym_slot(struct symtab *syms, const char *name, size_t len,
+                            uint32_t hash) {
+  size_t mask = syms->num_slots - 1;
+  size_t i = hash & mask;
+
+  while (syms->slots[i].index) {
+    if (syms->slots[i].hash == hash) {
+      const char *id = syms->symbols[syms->slots[i].index - 1].id;
+      if (strncmp(id, name, len) == 0 && id[len] == '\0')
         break;
-        
-      default:
-        strcpy(instr, opcode->name);
-      }
     }
+    i = (i + 1) & mask;
+  }
 
-    while (num_bytes--) {
-      sprintf(prefix + strlen(prefix), "%02X ", mem[instr_pc++]);
+  return &syms->slots[i];
+}
+
+/* keeps the index at most half full */
+static void sym_rehash(struct symtab *syms) {
+  sym_slot_t *old = syms->slots;
+  size_t num_old = syms->num_slots;
+  size_t i;
+
+  syms->num_slots = (num_old ? num_old * 2 : 64);
+  syms->slots = calloc(syms->num_slots, sizeof *syms->slots);
+
+  for (i = 0; i < num_old; ++i) {
+    if (old[i].index) {
+      size_t mask = syms->num_slots - 1;
+      size_t j = old[i].hash & mask;
+      while (syms->slots[j].index)
+        j = (j + 1) & mask;
+      syms->slots[j] = old[i];
     }
+  }
+
+  free(old);
+}
+
+static sym_def_t *sym_find(struct symtab *syms, const char *name, size_t len) {
+  if (!syms->num_slots)
+    return NULL;
+
+  uint32_t idx = sym_slot(syms, name, len, sym_hash(name, len))->index;
+  return (idx ? &syms->symbols[idx - 1] : NULL);
+}
+
+/* defines the symbol, or fills in one that was only referenced so far.
+ * returns NULL if it's already defined */
+static sym_def_t *sym_add(struct symtab *syms, const char *name, size_t len,
+                          uint16_t address, uint8_t flags) {
+  if ((syms->num_symbols + 1) * 2 > syms->num_slots)
+    sym_rehash(syms);
+
+  uint32_t hash = sym_hash(name, len);
+  sym_slot_t *slot = sym_slot(syms, name, len, hash);
+  if (slot->index) {
+    sym_def_t *symdef = &syms->symbols[slot->index - 1];
+    if (!(symdef->flags & SYM_UNDEFINED) || (flags & SYM_UNDEFINED))
+      return NULL;
+
+    symdef->address = address;
+    symdef->flags = flags;
+    if (syms->by_address) {
+      free(syms->by_address);
+      syms->by_address = NULL;
+    }
+    return symdef;
+  }
+
+  if (syms->num_symbols == syms->max_symbols) {
+    syms->max_symbols = (syms->max_symbols ? syms->max_symbols * 2 : 64);
+    syms->symbols = realloc(syms->symbols,
+                            syms->max_symbols * sizeof *syms->symbols);
+  }
+
+  sym_def_t *symdef = &syms->symbols[syms->num_symbols++];
+  symdef->id = sym_intern(syms, name, len);
+  symdef->address = address;
+  symdef->flags = flags;
+  slot->hash = hash;
+  slot->index = syms->num_symbols;
+
+  if (syms->by_address) {
+    free(syms->by_address);
+    syms->by_address = NULL;
+  }
+  return symdef;
+}
+
+/* makes a defined symbol undefined again, references to it are kept */
+void sym_forget(struct symtab *syms, sym_def_t *symdef) {
+  symdef->flags |= SYM_UNDEFINED;
+  if (syms->by_address) {
+    free(syms->by_address);
+    syms->by_address = NULL;
+  }
+}
+
+/* the symbol, an undefined entry for it is added if it's not there */
+static uint32_t sym_ref(struct symtab *syms, const char *name, size_t len) {
+  sym_def_t *symdef = sym_find(syms, name, len);
+  if (!symdef)
+    symdef = sym_add(syms, name, len, 0, SYM_UNDEFINED);
+
+  return symdef - syms->symbols;
+}
+
+sym_def_t *sym_lookup(struct symtab *syms, const char *name) {
+  sym_def_t *symdef = sym_find(syms, name, strlen(name));
+  return (symdef && !(symdef->flags & SYM_UNDEFINED) ? symdef : NULL);
+}
+
+/* returns NULL if the symbol already exists */
+sym_def_t *sym_define(struct symtab *syms, const char *name,
+                      uint16_t address, uint8_t flags) {
+  return sym_add(syms, name, strlen(name), address, flags);
+}
 
-    printf("%-16s %s\n", prefix, instr);
+static const sym_def_t *sort_base;
+
+static int cmp_address(const void *a, const void *b) {
+  const sym_def_t *sa = &sort_base[*(const uint32_t *)a];
+  const sym_def_t *sb = &sort_base[*(const uint32_t *)b];
+  if ((sa->flags ^ sb->flags) & SYM_UNDEFINED)
+    return (sa->flags & SYM_UNDEFINED ? 1 : -1);
+  if (sa->address != sb->address)
+    return (sa->address < sb->address ? -1 : 1);
+
+  /* same address: keep definition order */
+  return (*(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1);
+}
+
+/* the i:th symbol in address order, for listings and map files. undefined
+ * symbols sort last and end the iteration */
+sym_def_t *sym_by_address(struct symtab *syms, size_t i) {
+  if (i >= syms->num_symbols)
+    return NULL;
+
+  if (!syms->by_address) {
+    size_t j;
+    syms->by_address = malloc(syms->num_symbols * sizeof *syms->by_address);
+    for (j = 0; j < syms->num_symbols; ++j)
+      syms->by_address[j] = j;
+
+    sort_base = syms->symbols;
+    qsort(syms->by_address, syms->num_symbols, sizeof *syms->by_address,
+          cmp_address);
   }
+
+  sym_def_t *symdef = &syms->symbols[syms->by_address[i]];
+  return (symdef->flags & SYM_UNDEFINED ? NULL : symdef);
 }
 
-static int isnotnl(int c) {return (c != '\n');}
-static int ischars(int c) {return (!isspace(c) && c != ';' && c != '\n');}
+/* a piece of the source, points into it and isn't terminated */
+typedef struct tok {
+  const char *s;
+  size_t len;
+} tok_t;
+
+typedef struct parser {
+  struct cpu_state *cpu;
+  struct symtab *sym;
+  tok_t *grps;              /* the groups of the current line */
+  size_t max_grps;
+  tok_t local_grps[8];      /* enough for any sane line */
+} parser_t;
 
-static void eat_while(const char **p, int (*pred)(int)) {
-  const char *pos = *p;
-  while (*pos && (*p = pos, pred(*pos++)));
+#define READ_CHUNK 0x10000
+
+static int tok_is(const tok_t *t, const char *str) {
+  return (strncmp(t->s, str, t->len) == 0 && str[t->len] == '\0');
+}
+
+static void asm_error(struct symtab *sym, const char *fmt, ...) {
+  va_list args;
+  sym->num_errors++;
+  fprintf(stderr, "error: ");
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
 }
 
-static int parse_value(const char *text, uint8_t mode,
-                       uint16_t *res, struct symtab *symbols) {
-  /* if text == NULL, there is no value */
-  if (mode != ADR_IMP && !text)
+/* operand syntax, the mode follows from this and the instruction */
+#define OPND_NONE   0
+#define OPND_IMM    1  /* #v */
+#define OPND_PLAIN  2  /* v */
+#define OPND_X      3  /* v,x */
+#define OPND_Y      4  /* v,y */
+#define OPND_IZX    5  /* (v,x) */
+#define OPND_IZY    6  /* (v),y */
+#define OPND_IND    7  /* (v) */
+
+#define EXPR_ZP     0x01  /* fits in the zero page */
+#define EXPR_FWD    0x02  /* refers to a symbol that isn't defined yet */
+#define EXPR_RELOC  0x04  /* refers to a symbol that will be relocated */
+#define EXPR_SYM    0x08  /* is a symbol, which is in symbol */
+
+typedef struct expr {
+  uint16_t val;
+  uint32_t symbol;          /* for EXPR_FWD */
+  uint8_t flags;
+} expr_t;
+
+/* a $hex or decimal number, all of the text has to be part of it */
+static int parse_num(const char *text, size_t len, long *res) {
+  int base = 10;
+  long val = 0;
+
+  if (len && *text == '$') {
+    base = 16;
+    text++;
+    len--;
+  }
+
+  if (!len)
     return -1;
-  
+
+  while (len--) {
+    int c = tolower((uint8_t)*text++);
+    int digit = (isdigit(c) ? c - '0' : (isxdigit(c) ? c - 'a' + 10 : base));
+    if (digit >= base)
+      return -1;
+
+    val = val * base + digit;
+    if (val > 0xFFFF)
+      return -1;
+  }
+
+  *res = val;
+  return 0;
+}
+
+/*
+ * A number or a label. Numbers are zero page if they're written that way:
+ * $12 and 18 are, $0012 isn't. Labels are if they're already defined below
+ * $100; a label that isn't defined yet, or that will be relocated, is taken
+ * as absolute.
+ */
+static int parse_expr(const char *text, size_t len, struct symtab *syms,
+                      expr_t *e) {
   long val;
-  char *end = 0;
+  size_t i;
 
-  switch (mode) {
-  case ADR_IMP:
+  e->flags = 0;
+  if (parse_num(text, len, &val) == 0) {
+    e->val = val;
+    if (text[0] == '$' ? len <= 3 : val <= 0xFF)
+      e->flags |= EXPR_ZP;
     return 0;
+  }
 
-  case ADR_ABS:  /* 12342, $123F, LABEL */
-    if (text[0] == '$')
-      val = strtol(text + 1, &end, 16);
-    else
-      val = strtol(text, &end, 10);
+  if (!len || !(isalpha((uint8_t)text[0]) || text[0] == '_'))
+    return -1;
 
-    if (end != (text[0] == '$' ? text + 1 : text)) {
-      *res = val;
-      return 2;
-    }
+  for (i = 1; i < len; ++i) {
+    if (!isalnum((uint8_t)text[i]) && text[i] != '_')
+      return -1;
+  }
+
+  sym_def_t *symbol = sym_find(syms, text, len);
+  e->flags |= EXPR_SYM;
+  if (symbol && (symbol->flags & SYM_RELOC)) {
+    e->val = symbol->address;
+    e->symbol = symbol - syms->symbols;
+    e->flags |= EXPR_RELOC;
+  }
+  else if (symbol && !(symbol->flags & SYM_UNDEFINED)) {
+    e->val = symbol->address;
+    e->symbol = symbol - syms->symbols;
+    if (e->val <= 0xFF)
+      e->flags |= EXPR_ZP;
+  }
+  else {
+    e->val = 0;
+    e->symbol = sym_ref(syms, text, len);
+    e->flags |= EXPR_FWD;
+  }
+
+  return 0;
+}
+
+static int ends_with(const tok_t *t, size_t skip, const char *suffix) {
+  size_t n = strlen(suffix);
+  size_t i;
+  if (t->len < skip + n)
+    return 0;
+
+  for (i = 0; i < n; ++i) {
+    if (tolower((uint8_t)t->s[t->len - n + i]) != suffix[i])
+      return 0;
+  }
+  return 1;
+}
+
+/* splits the operand into its syntax and value, -1 if it makes no sense */
+static int parse_operand(const tok_t *text, struct symtab *syms, expr_t *e) {
+  if (!text)
+    return OPND_NONE;
 
-    /* maybe it's a label, let's try it */
+  const char *val = text->s;
+  size_t len = text->len;
+  int syntax = OPND_PLAIN;
 
-    if (text[0] == '$')
+  if (val[0] == '#') {
+    syntax = OPND_IMM;
+    val++;
+    len--;
+  }
+  else if (val[0] == '(') {
+    if (ends_with(text, 1, ",x)"))
+      syntax = OPND_IZX;
+    else if (ends_with(text, 1, "),y"))
+      syntax = OPND_IZY;
+    else if (ends_with(text, 1, ")"))
+      syntax = OPND_IND;
+    else
       return -1;
 
-    while (*end) {
-      if (!isalpha(*end))
-        return -1;
-      end++;
-    }
-    /* note: we've ruined 'end' here */
+    val++;
+    len -= (syntax == OPND_IND ? 2 : 4);
+  }
+  else if (ends_with(text, 0, ",x")) {
+    syntax = OPND_X;
+    len -= 2;
+  }
+  else if (ends_with(text, 0, ",y")) {
+    syntax = OPND_Y;
+    len -= 2;
+  }
+
+  return (parse_expr(val, len, syms, e) == 0 ? syntax : -1);
+}
+
+/* the zero page mode if the value fits there, or if there's no other */
+static int zp_or_abs(const instr_set_t *instr, int zp, int abs,
+                     const expr_t *e) {
+  if (((e->flags & EXPR_ZP) && (instr->modes & (1 << zp))) ||
+      !(instr->modes & (1 << abs)))
+    return zp;
+
+  return abs;
+}
+
+static int pick_mode(const instr_set_t *instr, int syntax, const expr_t *e) {
+  switch (syntax) {
+  case OPND_NONE:  return ADR_IMP;
+  case OPND_IMM:   return ADR_IMM;
+  case OPND_IZX:   return ADR_IZX;
+  case OPND_IZY:   return ADR_IZY;
+  case OPND_IND:   return ADR_IND;
+  case OPND_X:     return zp_or_abs(instr, ADR_ZPX, ADR_ABX, e);
+  case OPND_Y:     return zp_or_abs(instr, ADR_ZPY, ADR_ABY, e);
+  case OPND_PLAIN:
+    if (instr->modes & (1 << ADR_REL))
+      return ADR_REL;
+    return zp_or_abs(instr, ADR_ZP, ADR_ABS, e);
+  }
+
+  return -1;
+}
+
+/* writes the operand at pos, the value is an address for ADR_REL */
+int asm_patch(uint8_t *mem, uint16_t pos, uint8_t mode, uint16_t val) {
+  int rel;
 
-    sym_def_t *symbol = sym_lookup(symbols, text);
-    if (!symbol) {
-      fprintf(stderr,
-              "error: symbol '%s' not defined\n", text);
+  switch (mode) {
+  case ADR_ABS:
+  case ADR_ABX:
+  case ADR_ABY:
+  case ADR_IND:
+    mem[pos] = val >> 8;
+    mem[(uint16_t)(pos + 1)] = val & 0xFF;
+    return 0;
+
+  case ADR_REL:
+    rel = (int)val - (uint16_t)(pos + 1);
+    if (rel < -128 || rel > 127) {
+      fprintf(stderr, "error: branch at $%04X to $%04X is out of range\n",
+              (uint16_t)(pos - 1), val);
       return -1;
     }
-    *res = symbol->address;
-    return 2;    
+    mem[pos] = (uint8_t)rel;
+    return 0;
 
-  case ADR_IMM:  /* #255, #$FA */
-    if (text[0] != '#')
+  default:
+    if (val > 0xFF) {
+      fprintf(stderr, "error: $%04X at $%04X doesn't fit in a byte\n",
+              val, (uint16_t)(pos - 1));
       return -1;
+    }
+    mem[pos] = val;
+    return 0;
+  }
+}
 
-    if (text[1] == '$')
-      val = strtol(text + 2, &end, 16);
-    else
-      val = strtol(text + 1, &end, 10);
+static asm_section_t *open_section(struct symtab *syms, uint16_t base,
+                                   uint16_t flags) {
+  if (syms->num_sections == syms->max_sections) {
+    syms->max_sections = (syms->max_sections ? syms->max_sections * 2 : 8);
+    syms->sections = realloc(syms->sections,
+                             syms->max_sections * sizeof *syms->sections);
+  }
 
-    if (end == (text[1] == '$' ? text + 2 : text + 1))
-      return -1;
+  asm_section_t *sec = &syms->sections[syms->num_sections++];
+  sec->base = base;
+  sec->flags = flags;
+  sec->size = 0;
+  return sec;
+}
 
-    if (val > 0xFF)
-      return -1;
+/* the section being assembled into, code before any org is relocatable */
+static asm_section_t *cur_section(struct symtab *syms, struct cpu_state *cpu) {
+  if (!syms->num_sections)
+    return open_section(syms, cpu->pc, SECTION_RELOC);
 
-    *res = val;
-    return 1;
+  return &syms->sections[syms->num_sections - 1];
+}
 
-    /* TODO: the rest of the modes */
+static void set_instr(asm_instr_t *in, uint16_t pos, uint8_t op,
+                      const expr_t *e) {
+  in->pos = pos;
+  in->op = op;
+  in->flags = (e && (e->flags & EXPR_SYM) ? ASM_INSTR_SYM : 0);
+  in->symbol = (in->flags ? e->symbol : 0);
+}
 
+static void add_instr(struct symtab *syms, uint16_t pos, uint8_t op,
+                      const expr_t *e) {
+  if (syms->num_instrs == syms->max_instrs) {
+    syms->max_instrs = (syms->max_instrs ? syms->max_instrs * 2 : 256);
+    syms->instrs = realloc(syms->instrs,
+                           syms->max_instrs * sizeof *syms->instrs);
   }
 
-  return -1;
+  set_instr(&syms->instrs[syms->num_instrs++], pos, op, e);
+}
+
+static void add_fixup(struct symtab *syms, uint32_t symbol, uint16_t pos,
+                      uint8_t mode) {
+  if (syms->num_fixups == syms->max_fixups) {
+    syms->max_fixups = (syms->max_fixups ? syms->max_fixups * 2 : 64);
+    syms->fixups = realloc(syms->fixups,
+                           syms->max_fixups * sizeof *syms->fixups);
+  }
+
+  fixup_t *fix = &syms->fixups[syms->num_fixups++];
+  fix->symbol = symbol;
+  fix->pos = pos;
+  fix->mode = mode;
+}
+
+/*
+ * Patches every fixup whose symbol is defined by now. The rest are errors,
+ * unless ASM_NO_LINK_ERROR is given; then they're kept for a later call.
+ */
+int asm_link(struct cpu_state *cpu, struct symtab *sym, int flags) {
+  size_t kept = 0;
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < sym->num_fixups; ++i) {
+    fixup_t *fix = &sym->fixups[i];
+    sym_def_t *symbol = &sym->symbols[fix->symbol];
+
+    if (!(symbol->flags & SYM_UNDEFINED)) {
+      if (asm_patch(cpu->mem, fix->pos, fix->mode, symbol->address) != 0) {
+        sym->num_errors++;
+        ret = -1;
+      }
+    }
+    else if (flags & ASM_NO_LINK_ERROR) {
+      sym->fixups[kept++] = *fix;
+    }
+    else {
+      asm_error(sym, "symbol '%s' used at $%04X is not defined\n",
+                symbol->id, (uint16_t)(fix->pos - 1));
+      ret = -1;
+    }
+  }
+
+  sym->num_fixups = kept;
+  return ret;
 }
 
 
-static void parse_line(const char *grps[], size_t num_grps,
+static void parse_line(const tok_t grps[], size_t num_grps,
                        struct cpu_state *cpu, struct symtab *sym) {
   /* 1: 3 label instr/keyword param*/
   /* 2: 2 label instr/keyword*/
@@ -167,143 +557,292 @@ static void parse_line(const char *grps[], size_t num_grps,
   /* 4: 1 instr/keyword */
   /* 5: 1 label */
 
-  uint16_t modes = 0;
+  const instr_set_t *instr = instr_opcodes(grps[0].s, grps[0].len);
   size_t instr_start = 0;
 
-  modes = instr_modes(grps[0]);
-
-  if (modes == 0) {
+  if (!instr) {
     /* first group isn't a valid instruction, maybe it's a keyword */
 
-    if (strcmp(grps[0], "org") == 0) {
-      assert(num_grps == 2);
-      uint16_t val;
-      if (parse_value(grps[1], ADR_ABS, &val, sym) != -1) {
-        printf("jumped to $0x%04X\n", val);
-        cpu->pc = val;
+    if (tok_is(&grps[0], "org")) {
+      expr_t e;
+      if (num_grps == 2 && parse_expr(grps[1].s, grps[1].len, sym, &e) == 0 &&
+          !(e.flags & (EXPR_FWD | EXPR_RELOC))) {
+#ifndef NDEBUG
+        printf("jumped to $0x%04X\n", e.val);
+#endif
+        cpu->pc = e.val;
+        if (sym->flags & ASM_RELOCATABLE)
+          open_section(sym, e.val, 0);
+        if (sym->line)
+          sym->line->flags |= ASM_LINE_ORG;
       }
       else {
-        fprintf(stderr,
-                "error: origin takes an absolute address - not %s\n", grps[1]);
+        asm_error(sym, "origin takes an absolute address - not %.*s\n",
+                  (int)(num_grps > 1 ? grps[1].len : 7),
+                  (num_grps > 1 ? grps[1].s : "nothing"));
         return;
       }
     }
     else {
-      assert(sym->num_symbols < 100 && "can't define any more symbols");
       uint8_t flags = 0;
-      char sym_name[64] = {0};
-      strncpy(sym_name, grps[0], sizeof sym_name - 1);
-      sym_name[sizeof sym_name - 1] = '\0';
-      
-      size_t len = strlen(sym_name);
-      if (len > 0 && sym_name[len - 1] == ':') {
-        sym_name[len - 1] = '\0';
+      size_t len = grps[0].len;
+      if (grps[0].s[len - 1] == ':') {
+        len--;
         flags |= SYM_GLOBAL;
       }
 
-      if (sym_lookup(sym, sym_name)) {
-        fprintf(stderr,
-                "error: symbol '%s' already defined\n", sym_name);
+      if ((sym->flags & ASM_RELOCATABLE) &&
+          (cur_section(sym, cpu)->flags & SECTION_RELOC))
+        flags |= SYM_RELOC;
+
+      sym_def_t *label = sym_add(sym, grps[0].s, len, cpu->pc, flags);
+      if (!label) {
+        asm_error(sym, "symbol '%.*s' already defined\n",
+                  (int)len, grps[0].s);
         return;
       }
 
-      printf("defining '%s' as $%04X\n", grps[0], cpu->pc);
+      if (sym->line) {
+        sym->line->flags |= ASM_LINE_LABEL;
+        sym->line->label = label - sym->symbols;
+      }
 
-      sym_def_t *symdef = &sym->symbols[sym->num_symbols++];
-      symdef->id = strdup(sym_name);
-      symdef->address = cpu->pc;
-      symdef->flags = flags;
+#ifndef NDEBUG
+      printf("defining '%.*s' as $%04X\n", (int)len, grps[0].s, cpu->pc);
+#endif
 
       if (num_grps > 1) {
         instr_start = 1;
-        modes = instr_modes(grps[1]);
+        instr = instr_opcodes(grps[1].s, grps[1].len);
         grps++; /* grps will now point to the instruction */
+
+        if (!instr) {
+          asm_error(sym, "'%.*s' isn't an instruction\n",
+                    (int)grps[0].len, grps[0].s);
+          return;
+        }
       }
     }
   }
 
-  if (modes) {
+  if (instr) {
     /* there's a valid instruction in there */
+    const tok_t *value = (num_grps - instr_start != 1 ? &grps[1] : NULL);
+    expr_t e;
+    int syntax = parse_operand(value, sym, &e);
+    int mode = (syntax != -1 ? pick_mode(instr, syntax, &e) : -1);
+
+    if (mode == -1 || !(instr->modes & (1 << mode))) {
+      asm_error(sym,
+                "the value given for '%s', %.*s, doesn't really work for me\n",
+                instr->name,
+                (int)(value ? value->len : 7), (value ? value->s : "nothing"));
+      return;
+    }
 
-    /* TODO: all these instr_modes and instr_named calls are doing more work
-     * than necessary. */
-
-    size_t i;
-    for (i = 0; i < ADR_MAX; ++i) {
-      uint16_t val;
-      int bytes;
-      const char *value = (num_grps - instr_start != 1 ?
-                           grps[1] : NULL);
-      if (modes & (1 << i) &&
-          (bytes = parse_value(value, i, &val, sym)) != -1) {
-        printf("%s with %s means mode %zu\n",
-               grps[0], grps[1], i);
-
-        uint8_t op = instr_named(grps[0], i);
-        assert(op);
-        cpu->mem[cpu->pc++] = op;
-
-        switch (bytes) {
-        case 2:  cpu->mem[cpu->pc++] = val >> 8;
-        case 1:  cpu->mem[cpu->pc++] = val & 0xFF;
-        case 0:  break;
-        default: assert(!"some strange amount of bytes");            
-        }
+#ifndef NDEBUG
+    printf("%s with %.*s means mode %d\n", instr->name,
+           (int)(value ? value->len : 0), (value ? value->s : ""), mode);
+#endif
 
-        break;
-      }
+    uint8_t op = instr->opcode[mode];
+    uint16_t pos = cpu->pc + 1;
+    cpu->mem[cpu->pc] = op;
+    cpu->pc += instr_len(op);
+
+    if (sym->flags & ASM_RELOCATABLE) {
+      asm_section_t *sec = cur_section(sym, cpu);
+      sec->size = (uint16_t)(cpu->pc - sec->base);
+    }
+
+    if (sym->flags & ASM_OPTIMIZE)
+      add_instr(sym, pos - 1, op, (mode == ADR_IMP ? NULL : &e));
+    if (sym->line) {
+      sym->line->flags |= ASM_LINE_INSTR;
+      set_instr(&sym->line->instr, pos - 1, op,
+                (mode == ADR_IMP ? NULL : &e));
     }
 
-    if (i == ADR_MAX) {
-      fprintf(stderr,
-              "error: the value given for '%s', %s, doesn't really work for me\n",
-              grps[0],
-              grps[1]);
+    if (mode == ADR_IMP)
       return;
+
+    if (e.flags & (EXPR_FWD | EXPR_RELOC)) {
+      memset(&cpu->mem[pos], 0, instr_len(op) - 1);
+      add_fixup(sym, e.symbol, pos, mode);
+    }
+    else {
+      if (asm_patch(cpu->mem, pos, mode, e.val) != 0)
+        sym->num_errors++;
     }
   }
 
 }
 
+/* isspace without the locale lookup, '\n' is handled by the caller */
+static int isblanks(int c) {return (c == ' ' || (c >= '\t' && c <= '\r'));}
+static int ischars(int c) {return (!isblanks(c) && c != ';');}
 
-void parse_asm(const char *text, struct cpu_state *cpu, struct symtab *sym) {
-  const char *pos = text;
-  char value[64] = {0};
-  char *val_ptr = value;
-  const char *val_grps[8];
-  size_t num_grps = 0;
-
-  while (*pos) {
-    eat_while(&pos, isspace);
-    const char *chars_start = pos;
-    eat_while(&pos, ischars);
-    size_t diff = pos - chars_start;
-
-    if (diff) {
-      if (val_ptr + diff >= value + sizeof value ||
-          num_grps >= sizeof val_grps / sizeof val_grps[0]) {
-        fprintf(stderr, "error: we ran out of space");
-        abort();
+/* splits the text into lines of groups, a group is a view into text */
+static void parse_lines(parser_t *p, const char *pos, const char *end) {
+  while (pos < end) {
+    size_t num_grps = 0;
+
+    while (pos < end && *pos != '\n') {
+      if (*pos == ';') {
+        while (pos < end && *pos != '\n')
+          pos++;
+        break;
       }
 
-      strncpy(val_ptr, chars_start, diff);
-      assert(num_grps < 8);
-      val_grps[num_grps++] = val_ptr;
-      val_ptr += diff;
-      *val_ptr++ = '\0';
+      if (isblanks(*pos)) {
+        pos++;
+        continue;
+      }
+
+      if (num_grps == p->max_grps) {
+        tok_t *grps = malloc(p->max_grps * 2 * sizeof *grps);
+        memcpy(grps, p->grps, p->max_grps * sizeof *grps);
+        if (p->grps != p->local_grps)
+          free(p->grps);
+        p->grps = grps;
+        p->max_grps *= 2;
+      }
+
+      tok_t *grp = &p->grps[num_grps++];
+      grp->s = pos;
+      while (pos < end && ischars(*pos))
+        pos++;
+      grp->len = pos - grp->s;
     }
 
-    if (*pos == ';') {
-      eat_while(&pos, isnotnl);
+    if (num_grps > 0)
+      parse_line(p->grps, num_grps, p->cpu, p->sym);
+
+    pos++;
+  }
+}
+
+static void parser_init(parser_t *p, struct cpu_state *cpu,
+                        struct symtab *sym) {
+  p->cpu = cpu;
+  p->sym = sym;
+  p->grps = p->local_grps;
+  p->max_grps = sizeof p->local_grps / sizeof p->local_grps[0];
+}
+
+static void parser_free(parser_t *p) {
+  if (p->grps != p->local_grps)
+    free(p->grps);
+}
+
+/* links what was assembled unless it's going into an object file, and
+ * optimizes it if asked to */
+static void asm_finish(struct cpu_state *cpu, struct symtab *sym) {
+  if (sym->flags & ASM_RELOCATABLE)
+    return;
+
+  if (asm_link(cpu, sym, 0) == 0 && !sym->num_errors &&
+      (sym->flags & ASM_OPTIMIZE))
+    asm_optimize(cpu, sym);
+}
+
+/* assembles the text, references to symbols it doesn't define are errors */
+void parse_asm(const char *text, struct cpu_state *cpu, struct symtab *sym) {
+  parser_t p;
+  parser_init(&p, cpu, sym);
+  parse_lines(&p, text, text + strlen(text));
+  parser_free(&p);
+  asm_finish(cpu, sym);
+}
+
+/*
+ * Assembles one line at the pc and tells what it did, for callers that
+ * keep track of lines and what they refer to themselves (see src.h). The
+ * line isn't linked: the operand of a symbol that isn't defined yet is
+ * left zero and no fixup is kept for it. Returns -1 on errors.
+ */
+int asm_line(struct cpu_state *cpu, struct symtab *sym, const char *text,
+             size_t len, asm_line_t *line) {
+  size_t errors = sym->num_errors, fixups = sym->num_fixups;
+  parser_t p;
+
+  memset(line, 0, sizeof *line);
+  sym->line = line;
+  parser_init(&p, cpu, sym);
+  parse_lines(&p, text, text + len);
+  parser_free(&p);
+  sym->line = NULL;
+  sym->num_fixups = fixups;
+  return (sym->num_errors != errors ? -1 : 0);
+}
+
+/*
+ * Assembles a file, "-" is stdin. Regular files are mapped and parsed in
+ * place; anything else is read in chunks and the complete lines in every
+ * chunk are parsed before the next read. Returns -1 if the file can't be
+ * read, assembly errors are only reported.
+ */
+int parse_asm_file(const char *path, struct cpu_state *cpu,
+                   struct symtab *sym) {
+  int fd = (strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY));
+  if (fd == -1)
+    return -1;
+
+  parser_t p;
+  parser_init(&p, cpu, sym);
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+      parse_lines(&p, map, (const char *)map + st.st_size);
+      munmap(map, st.st_size);
+      parser_free(&p);
+      asm_finish(cpu, sym);
+      if (fd != STDIN_FILENO)
+        close(fd);
+      return 0;
     }
+  }
 
-    if (*pos == '\n') {
-      if (num_grps > 0)
-        parse_line(val_grps, num_grps, cpu, sym);
-      
-      num_grps = 0;
-      val_ptr = value;
-      pos++;
+  size_t cap = READ_CHUNK, len = 0;
+  char *buf = malloc(cap);
+  ssize_t n;
+
+  for (;;) {
+    n = read(fd, buf + len, cap - len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    /* only the new bytes can end the last line */
+    size_t end = len + n;
+    while (end > len && buf[end - 1] != '\n')
+      end--;
+    len += n;
+
+    if (end > 0 && buf[end - 1] == '\n') {
+      parse_lines(&p, buf, buf + end);
+      memmove(buf, buf + end, len - end);
+      len -= end;
+    }
+    else if (len == cap) {
+      /* a line longer than the buffer */
+      cap *= 2;
+      buf = realloc(buf, cap);
     }
   }
+
+  if (n == 0) {
+    parse_lines(&p, buf, buf + len);
+    asm_finish(cpu, sym);
+  }
+
+  free(buf);
+  parser_free(&p);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return (n == 0 ? 0 : -1);
 }
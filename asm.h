@@ -2,7 +2,8 @@
 #define P64_ASM_H
 
 /*
- * A non-optimizing assembler & disassembler for 6502 asm.
+ * An assembler for 6502 asm, with an optional peephole pass over the
+ * emitted code (see opt.h). The disassembler is in dis.h.
  * Perhaps it would be best to move it into 6502.c/.h.
  */
 
@@ -12,7 +13,13 @@
 
 
 #define SYM_GLOBAL         0x01
+#define SYM_UNDEFINED      0x02  /* referenced but not defined yet */
+#define SYM_RELOC          0x04  /* offset into the relocatable section */
 #define ASM_NO_LINK_ERROR  0x01
+#define ASM_RELOCATABLE    0x02  /* symtab flag, assemble for an object */
+#define ASM_OPTIMIZE       0x04  /* symtab flag, run opt.c when linked */
+#define ASM_INSTR_SYM      0x01  /* the operand is a symbol's address */
+#define SECTION_RELOC      0x01
 
 typedef struct sym_def {
   char *id;
@@ -20,13 +27,85 @@ typedef struct sym_def {
   uint8_t flags;
 } sym_def_t;
 
+typedef struct sym_slot {
+  uint32_t hash;
+  uint32_t index;           /* into symbols + 1, 0 is empty */
+} sym_slot_t;
+
+/* an operand that refers to a symbol that wasn't defined when it was
+ * assembled, patched by asm_link */
+typedef struct fixup {
+  uint32_t symbol;          /* index into symbols */
+  uint16_t pos;             /* of the operand */
+  uint8_t mode;
+} fixup_t;
+
+/* an instruction as it was emitted, recorded with ASM_OPTIMIZE */
+typedef struct asm_instr {
+  uint16_t pos;
+  uint8_t op;
+  uint8_t flags;
+  uint32_t symbol;          /* with ASM_INSTR_SYM */
+} asm_instr_t;
+
+/* what one line did, see asm_line */
+#define ASM_LINE_LABEL     0x01  /* label is the symbol it defined */
+#define ASM_LINE_ORG       0x02  /* it moved the pc */
+#define ASM_LINE_INSTR     0x04  /* instr is what it emitted */
+
+typedef struct asm_line {
+  uint8_t flags;
+  uint32_t label;
+  asm_instr_t instr;
+} asm_line_t;
+
+/* a range of assembled code. with ASM_RELOCATABLE, code before the first
+ * org goes into a relocatable section based at the starting pc, every org
+ * starts an absolute one */
+typedef struct asm_section {
+  uint16_t base;
+  uint16_t flags;
+  uint32_t size;
+} asm_section_t;
+
+/*
+ * Symbols are kept in definition order and found through an open
+ * addressing hash index over them. Both grow as needed; a zeroed symtab_t
+ * is an empty table. The names are copied once into an arena owned by the
+ * table. A symbol that is used before it's defined gets an entry flagged
+ * SYM_UNDEFINED, filled in by its definition.
+ */
 typedef struct symtab {
-  sym_def_t symbols[100];
-  size_t num_symbols;
+  struct name_chunk *names; /* arena the ids are interned in */
+  size_t names_left;
+  sym_def_t *symbols;
+  size_t num_symbols, max_symbols;
+  sym_slot_t *slots;
+  size_t num_slots;         /* a power of 2 */
+  uint32_t *by_address;     /* sorted indices, NULL when out of date */
+  fixup_t *fixups;
+  size_t num_fixups, max_fixups;
+  uint8_t flags;
+  size_t num_errors;        /* reported while assembling */
+  asm_section_t *sections;  /* with ASM_RELOCATABLE */
+  size_t num_sections, max_sections;
+  asm_instr_t *instrs;      /* with ASM_OPTIMIZE */
+  size_t num_instrs, max_instrs;
+  asm_line_t *line;         /* while asm_line runs */
 } symtab_t;
 
 void print_instr(uint8_t *, uint16_t len, uint16_t start_ofs);
 void parse_asm(const char *, struct cpu_state *, struct symtab *);
+int parse_asm_file(const char *path, struct cpu_state *, struct symtab *);
+int asm_line(struct cpu_state *, struct symtab *, const char *text,
+             size_t len, asm_line_t *);
+int asm_link(struct cpu_state *, struct symtab *, int flags);
+int asm_patch(uint8_t *mem, uint16_t pos, uint8_t mode, uint16_t val);
 void sym_clear(struct symtab *syms);
+sym_def_t *sym_lookup(struct symtab *syms, const char *name);
+sym_def_t *sym_define(struct symtab *syms, const char *name,
+                      uint16_t address, uint8_t flags);
+void sym_forget(struct symtab *syms, sym_def_t *symdef);
+sym_def_t *sym_by_address(struct symtab *syms, size_t i);
 
 #endif /* !P64_ASM_H */
@@ -0,0 +1,670 @@
+/*
+ * Emulator throughput benchmarks.
+ *
+ * usage: p64bench [-o results.json] [-t seconds per trial] [-m] [-A]
+ *
+ * Every workload is run in 5 trials of at least -t seconds each (default
+ * 0.2), the best trial is reported. Results also go to a JSON file so they
+ * can be compared across commits. -m runs everything with memoization of
+ * pure subroutines turned on; a memoized call counts as one instruction
+ * then, so compare us/run.
+ *
+ * The assembler is timed on generated sources of 1k up to 1M labels, where
+ * every line defines a label and jumps to an earlier one; the time per
+ * label should stay flat. -A skips it.
+ *
+ * The disassembler is timed listing a 64k image of random bytes into a
+ * buffer, which is the worst case for it.
+ *
+ * Save states are timed on two series of checkpoints: the image workload
+ * every 100 instructions, and memory getting random writes with some
+ * pages of noise now and then. Loading them back in order is compared to
+ * reading 64k dumps of the same states with fseek and fread.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "6502.h"
+#include "prg.h"
+#include "memo.h"
+#include "asm.h"
+#include "dis.h"
+#include "state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#ifndef P64_REV
+#define P64_REV "unknown"
+#endif
+
+#define NUM_TRIALS 5
+#define NUM_ASM_SIZES 4
+#define CODE_START 0x1000
+
+typedef struct workload {
+  const char *name;
+  int (*setup)(cpu_state_t *);
+} workload_t;
+
+typedef struct result {
+  uint64_t instructions;  /* per run */
+  double ns_per_instr;
+  double us_per_run;
+} result_t;
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void reset(cpu_state_t *cpu) {
+  memset(cpu, 0, sizeof *cpu);
+  cpu->ps = 0x20;
+  cpu->sp = 0xFF;
+  cpu->pc = CODE_START;
+}
+
+static int setup_alu(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA0, 0x40,        /* 1000      ldy #$40 */
+    0xA2, 0x00,        /* 1002 o:   ldx #0 */
+    0x69, 0x01,        /* 1004 i:   adc #1 */
+    0x49, 0x55,        /* 1006      eor #$55 */
+    0x09, 0x01,        /* 1008      ora #1 */
+    0x29, 0xFE,        /* 100A      and #$FE */
+    0xE9, 0x03,        /* 100C      sbc #3 */
+    0xE8,              /* 100E      inx */
+    0xD0, 0xF3,        /* 100F      bne i */
+    0x88,              /* 1011      dey */
+    0xD0, 0xEE,        /* 1012      bne o */
+    0x00
+  };
+
+  reset(cpu);
+  memcpy(&cpu->mem[CODE_START], code, sizeof code);
+  return 0;
+}
+
+static int setup_memcpy(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA0, 0x40,        /* 1000      ldy #$40 */
+    0xA2, 0x00,        /* 1002 o:   ldx #0 */
+    0xBD, 0x20, 0x00,  /* 1004 i:   lda $2000,x */
+    0x9D, 0x30, 0x00,  /* 1007      sta $3000,x */
+    0xE8,              /* 100A      inx */
+    0xD0, 0xF7,        /* 100B      bne i */
+    0x88,              /* 100D      dey */
+    0xD0, 0xF2,        /* 100E      bne o */
+    0x00
+  };
+
+  reset(cpu);
+  memcpy(&cpu->mem[CODE_START], code, sizeof code);
+
+  size_t i;
+  for (i = 0; i < 0x100; ++i)
+    cpu->mem[0x2000 + i] = i * 7;
+  return 0;
+}
+
+static int setup_branches(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA9, 0x40,        /* 1000      lda #$40 */
+    0x85, 0x10,        /* 1002      sta $10 */
+    0xA2, 0x00,        /* 1004 o:   ldx #0 */
+    0x8A,              /* 1006 l:   txa */
+    0x29, 0x01,        /* 1007      and #1 */
+    0xF0, 0x04,        /* 1009      beq e */
+    0xC8,              /* 100B      iny */
+    0x4C, 0x10, 0x17,  /* 100C      jmp n */
+    0x8A,              /* 100F e:   txa */
+    0x29, 0x02,        /* 1010      and #2 */
+    0xD0, 0x01,        /* 1012      bne s */
+    0x88,              /* 1014      dey */
+    0x30, 0x00,        /* 1015 s:   bmi n */
+    0xE8,              /* 1017 n:   inx */
+    0xD0, 0xEC,        /* 1018      bne l */
+    0xC6, 0x10,        /* 101A      dec $10 */
+    0xD0, 0xE6,        /* 101C      bne o */
+    0x00
+  };
+
+  reset(cpu);
+  memcpy(&cpu->mem[CODE_START], code, sizeof code);
+  return 0;
+}
+
+#define CHAIN_START 0x1100
+#define CHAIN_DEPTH 16
+
+static int setup_calls(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA0, 0x10,        /* 1000      ldy #$10 */
+    0xA2, 0x00,        /* 1002 o:   ldx #0 */
+    0x20, 0x11, 0x00,  /* 1004 i:   jsr $1100 */
+    0xE8,              /* 1007      inx */
+    0xD0, 0xFA,        /* 1008      bne i */
+    0x88,              /* 100A      dey */
+    0xD0, 0xF5,        /* 100B      bne o */
+    0x00
+  };
+
+  reset(cpu);
+  memcpy(&cpu->mem[CODE_START], code, sizeof code);
+
+  /* each level is "jsr next; rts", the last one just returns */
+  uint16_t pc = CHAIN_START;
+  int i;
+  for (i = 0; i < CHAIN_DEPTH - 1; ++i) {
+    uint16_t next = pc + 4;
+    cpu->mem[pc++] = 0x20;
+    cpu->mem[pc++] = next >> 8;
+    cpu->mem[pc++] = next & 0xFF;
+    cpu->mem[pc++] = 0x60;
+  }
+  cpu->mem[pc] = 0x60;
+  return 0;
+}
+
+static int setup_mul(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA0, 0x40,        /* 1000      ldy #$40 */
+    0xA2, 0x00,        /* 1002 o:   ldx #0 */
+    0x8A,              /* 1004 i:   txa */
+    0x29, 0x0F,        /* 1005      and #$0F */
+    0x85, 0xFB,        /* 1007      sta $FB */
+    0xA9, 0x07,        /* 1009      lda #7 */
+    0x85, 0xFC,        /* 100B      sta $FC */
+    0x86, 0xFA,        /* 100D      stx $FA */
+    0x20, 0x11, 0x00,  /* 100F      jsr mul */
+    0xA6, 0xFA,        /* 1012      ldx $FA */
+    0xE8,              /* 1014      inx */
+    0xD0, 0xED,        /* 1015      bne i */
+    0x88,              /* 1017      dey */
+    0xD0, 0xE8,        /* 1018      bne o */
+    0x00
+  };
+
+  /* $FD = $FB * $FC by repeated addition */
+  static const uint8_t mul[] = {
+    0xA9, 0x00,        /* 1100 mul: lda #0 */
+    0xA6, 0xFB,        /* 1102      ldx $FB */
+    0xF0, 0x06,        /* 1104      beq d */
+    0x18,              /* 1106 l:   clc */
+    0x65, 0xFC,        /* 1107      adc $FC */
+    0xCA,              /* 1109      dex */
+    0xD0, 0xFA,        /* 110A      bne l */
+    0x85, 0xFD,        /* 110C d:   sta $FD */
+    0x60               /* 110E      rts */
+  };
+
+  reset(cpu);
+  memcpy(&cpu->mem[CODE_START], code, sizeof code);
+  memcpy(&cpu->mem[0x1100], mul, sizeof mul);
+  return 0;
+}
+
+/* the program at the top of main.c */
+static int setup_sample(cpu_state_t *cpu) {
+  static const uint8_t code[] = {
+    0xA9, 0xFA, 0x69, 0x06, 0x08, 0x18, 0x28, 0xBA,
+    0x8E, 0x13, 0x37, 0xEA, 0xEA, 0x20, 0x00, 0x18,
+    0xA2, 0x02, 0xB4, 0x01,    0,    0,    0,    0,
+    0x18, 0xA9, 0x02, 0x09, 0x08, 0x60,    0,    0
+  };
+
+  reset(cpu);
+  cpu->pc = 0;
+  memcpy(cpu->mem, code, sizeof code);
+  return 0;
+}
+
+#define IMAGE_START  0x0800
+#define IMAGE_BLOCKS 2500
+
+/* ~30k of straight line code, written out as a .prg and loaded back */
+static int setup_image(cpu_state_t *cpu) {
+  static const uint8_t block[] = {
+    0xA9, 0x12,        /* lda #$12 */
+    0x65, 0x40,        /* adc $40 */
+    0x85, 0x41,        /* sta $41 */
+    0xB5, 0x40,        /* lda $40,x */
+    0x8D, 0x20, 0x00,  /* sta $2000 */
+    0xE8               /* inx */
+  };
+
+  static uint8_t image[2 + 2 + IMAGE_BLOCKS * sizeof block + 7];
+  size_t len = 0;
+  int i;
+
+  image[len++] = IMAGE_START & 0xFF;
+  image[len++] = IMAGE_START >> 8;
+  image[len++] = 0xA0;                    /* ldy #8 */
+  image[len++] = 0x08;
+  for (i = 0; i < IMAGE_BLOCKS; ++i) {
+    memcpy(&image[len], block, sizeof block);
+    len += sizeof block;
+  }
+  image[len++] = 0x88;                    /* dey */
+  image[len++] = 0xF0;                    /* beq +3 */
+  image[len++] = 0x03;
+  image[len++] = 0x4C;                    /* jmp start + 2 */
+  image[len++] = (IMAGE_START + 2) >> 8;
+  image[len++] = (IMAGE_START + 2) & 0xFF;
+  image[len++] = 0x00;
+
+  char path[] = "/tmp/p64bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1 || write(fd, image, len) != (ssize_t)len) {
+    perror("can't write the image");
+    return -1;
+  }
+  close(fd);
+
+  reset(cpu);
+  int ret = load_prg(cpu, path);
+  unlink(path);
+  cpu->pc = IMAGE_START;
+  return ret;
+}
+
+static const workload_t workloads[] = {
+  {"alu",      setup_alu},
+  {"memcpy",   setup_memcpy},
+  {"branches", setup_branches},
+  {"calls",    setup_calls},
+  {"mul",      setup_mul},
+  {"sample",   setup_sample},
+  {"image",    setup_image}
+};
+
+#define NUM_WORKLOADS (sizeof workloads / sizeof workloads[0])
+
+static int run_workload(const workload_t *w, double trial_s, result_t *res) {
+  static cpu_state_t base, cpu;
+
+  if (w->setup(&base) != 0)
+    return -1;
+
+  /* every run starts from the same state, copying it isn't timed */
+  memcpy(&cpu, &base, sizeof cpu);
+  if (run_machine_for(&cpu, 0, &res->instructions) != STOP_BRK) {
+    fprintf(stderr, "error: %s didn't run to completion\n", w->name);
+    return -1;
+  }
+
+  double best = 0;
+  int trial;
+  for (trial = 0; trial < NUM_TRIALS; ++trial) {
+    uint64_t total_ns = 0, total_instrs = 0, runs = 0;
+
+    while (total_ns < trial_s * 1e9) {
+      uint64_t n;
+      memcpy(&cpu, &base, sizeof cpu);
+      uint64_t t0 = mono_ns();
+      run_machine_for(&cpu, 0, &n);
+      total_ns += mono_ns() - t0;
+      total_instrs += n;
+      runs++;
+    }
+
+    double ns = (double)total_ns / total_instrs;
+    if (trial == 0 || ns < best) {
+      best = ns;
+      res->us_per_run = total_ns / 1e3 / runs;
+    }
+  }
+
+  res->ns_per_instr = best;
+  return 0;
+}
+
+/* labels are letters only, 'l' and five base 26 digits */
+static char *label_name(char *out, size_t n) {
+  int i;
+  *out++ = 'l';
+  for (i = 4; i >= 0; --i) {
+    out[i] = 'a' + n % 26;
+    n /= 26;
+  }
+  out[5] = '\0';
+  return out + 5;
+}
+
+/* best of NUM_TRIALS, in ns per label. bytes gets the source size */
+static double run_asm(size_t labels, size_t *bytes) {
+  static cpu_state_t cpu;
+  char *text = malloc(labels * 20 + 1);
+  char *p = text;
+  size_t i;
+
+  for (i = 0; i < labels; ++i) {
+    p = label_name(p, i);
+    p += sprintf(p, " jmp ");
+    p = label_name(p, i / 2);
+    *p++ = '\n';
+  }
+  *p = '\0';
+  *bytes = p - text;
+
+  double best = 0;
+  int trial;
+  for (trial = 0; trial < NUM_TRIALS; ++trial) {
+    symtab_t syms = {0};
+    reset(&cpu);
+    uint64_t t0 = mono_ns();
+    parse_asm(text, &cpu, &syms);
+    double ns = (double)(mono_ns() - t0) / labels;
+    if (syms.num_symbols != labels) {
+      fprintf(stderr, "error: assembled %zu of %zu labels\n",
+              syms.num_symbols, labels);
+      ns = 0;
+    }
+    sym_clear(&syms);
+
+    if (trial == 0 || ns < best)
+      best = ns;
+  }
+
+  free(text);
+  return best;
+}
+
+/* best of NUM_TRIALS, in us per image. lines gets the lines per image */
+static double run_dis(double trial_s, size_t *lines) {
+  static uint8_t mem[MEM_MAX + 1];
+  static char text[(MEM_MAX + 1) * DIS_LINE_MAX];
+  uint32_t seed = 1;
+  size_t i;
+
+  for (i = 0; i <= MEM_MAX; ++i) {
+    seed = seed * 1103515245 + 12345;
+    mem[i] = seed >> 16;
+  }
+
+  double best = 0;
+  int trial;
+  for (trial = 0; trial < NUM_TRIALS; ++trial) {
+    uint64_t total_ns = 0, runs = 0;
+
+    while (total_ns < trial_s * 1e9) {
+      dis_iter_t it;
+      dis_begin(&it, mem, 0, MEM_MAX + 1);
+      uint64_t t0 = mono_ns();
+      size_t len = dis_text(&it, text, sizeof text);
+      total_ns += mono_ns() - t0;
+      runs++;
+
+      if (it.left) {
+        fprintf(stderr, "error: the listing didn't fit\n");
+        return 0;
+      }
+      *lines = 0;
+      for (i = 0; i < len; ++i)
+        *lines += (text[i] == '\n');
+    }
+
+    double us = total_ns / 1e3 / runs;
+    if (trial == 0 || us < best)
+      best = us;
+  }
+
+  return best;
+}
+
+#define NUM_CHECKPOINTS 1000
+
+typedef struct state_result {
+  const char *name;
+  double bytes_per_state;
+  double us_append, us_load, us_fread;  /* per state */
+} state_result_t;
+
+/* the image workload, NUM_CHECKPOINTS times 100 instructions */
+static void next_image(cpu_state_t *cpu, int i) {
+  uint64_t executed;
+  if (i == 0)
+    setup_image(cpu);
+  run_machine_for(cpu, 100, &executed);
+}
+
+/* a few dozen random writes, 4k of noise every 100 states */
+static void next_noisy(cpu_state_t *cpu, int i) {
+  static uint32_t seed;
+  int n;
+
+  if (i == 0) {
+    setup_image(cpu);
+    seed = 1;
+  }
+
+  for (n = 0; n < (i % 100 ? 40 : 4096); ++n) {
+    seed = seed * 1103515245 + 12345;
+    uint16_t at = (i % 100 ? seed >> 16 : 0x8000 + n);
+    cpu->mem[at] = seed >> 8;
+  }
+  cpu->pc = seed >> 16;
+}
+
+static uint64_t time_loads(state_file_t *s, FILE *raw, cpu_state_t *cpu) {
+  uint64_t t0 = mono_ns();
+  size_t i;
+
+  for (i = 0; i < NUM_CHECKPOINTS; ++i) {
+    if (s) {
+      state_load(s, i, cpu);
+    }
+    else {
+      fseek(raw, (long)i * sizeof *cpu, SEEK_SET);
+      if (fread(cpu, sizeof *cpu, 1, raw) != 1)
+        return 0;
+    }
+  }
+  return mono_ns() - t0;
+}
+
+/* best of NUM_TRIALS loads of every state, after checking they match */
+static int run_states(void (*next)(cpu_state_t *, int), state_result_t *res) {
+  static cpu_state_t cpu, loaded;
+  char path[] = "/tmp/p64bench-XXXXXX", raw_path[] = "/tmp/p64bench-XXXXXX";
+  int fd = mkstemp(path), raw_fd = mkstemp(raw_path);
+  FILE *raw = fdopen(raw_fd, "w+b");
+  int i, failed = 0;
+
+  if (fd == -1 || !raw) {
+    perror("can't write the states");
+    return -1;
+  }
+  close(fd);
+
+  state_writer_t *w = state_create(path);
+  uint64_t append_ns = 0;
+  for (i = 0; i < NUM_CHECKPOINTS; ++i) {
+    next(&cpu, i);
+    uint64_t t0 = mono_ns();
+    failed |= (state_append(w, &cpu) != i);
+    append_ns += mono_ns() - t0;
+    failed |= (fwrite(&cpu, sizeof cpu, 1, raw) != 1);
+  }
+  failed |= state_finish(w);
+  fflush(raw);
+
+  state_file_t *s = state_open(path);
+  if (failed || !s) {
+    fprintf(stderr, "error: can't write the %s states\n", res->name);
+    return -1;
+  }
+
+  for (i = 0; i < NUM_CHECKPOINTS; ++i) {
+    fseek(raw, (long)i * sizeof cpu, SEEK_SET);
+    if (state_load(s, i, &loaded) != 0 || fread(&cpu, sizeof cpu, 1, raw) != 1 ||
+        memcmp(&cpu, &loaded, sizeof cpu) != 0) {
+      fprintf(stderr, "error: %s state %d didn't load back\n", res->name, i);
+      return -1;
+    }
+  }
+
+  struct stat st;
+  stat(path, &st);
+  res->bytes_per_state = (double)st.st_size / NUM_CHECKPOINTS;
+  res->us_append = append_ns / 1e3 / NUM_CHECKPOINTS;
+
+  int trial;
+  for (trial = 0; trial < NUM_TRIALS; ++trial) {
+    double load = time_loads(s, NULL, &loaded) / 1e3 / NUM_CHECKPOINTS;
+    double read = time_loads(NULL, raw, &loaded) / 1e3 / NUM_CHECKPOINTS;
+    if (trial == 0 || load < res->us_load)
+      res->us_load = load;
+    if (trial == 0 || read < res->us_fread)
+      res->us_fread = read;
+  }
+
+  state_close(s);
+  fclose(raw);
+  unlink(path);
+  unlink(raw_path);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *json_path = "bench.json";
+  double trial_s = 0.2;
+  int memo = 0, skip_asm = 0;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-m") == 0)
+      memo = 1;
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      json_path = argv[++i];
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      trial_s = atof(argv[++i]);
+    else if (strcmp(argv[i], "-A") == 0)
+      skip_asm = 1;
+  }
+
+  if (memo) {
+    memo_config_t cfg = {.io_lo = 0xD000, .io_hi = 0xDFFF};
+    memo_enable(&cfg);
+  }
+
+  result_t results[NUM_WORKLOADS];
+  int failed = 0;
+  size_t w;
+
+  printf("%-10s %12s %10s %10s %10s\n",
+         "workload", "instrs/run", "mips", "ns/instr", "us/run");
+  for (w = 0; w < NUM_WORKLOADS; ++w) {
+    if (run_workload(&workloads[w], trial_s, &results[w]) != 0) {
+      results[w].instructions = 0;
+      failed = 1;
+      continue;
+    }
+
+    printf("%-10s %12llu %10.2f %10.2f %10.1f\n", workloads[w].name,
+           (unsigned long long)results[w].instructions,
+           1e3 / results[w].ns_per_instr, results[w].ns_per_instr,
+           results[w].us_per_run);
+  }
+
+  if (memo)
+    memo_print_stats(stdout);
+
+  static const size_t asm_sizes[NUM_ASM_SIZES] = {1000, 10000, 100000, 1000000};
+  double asm_ns[NUM_ASM_SIZES];
+  size_t asm_bytes[NUM_ASM_SIZES];
+  if (!skip_asm) {
+    printf("\n%-10s %12s %10s %10s\n", "labels", "ms", "ns/label", "MB/s");
+    for (w = 0; w < NUM_ASM_SIZES; ++w) {
+      asm_ns[w] = run_asm(asm_sizes[w], &asm_bytes[w]);
+      if (!asm_ns[w])
+        failed = 1;
+      printf("%-10zu %12.1f %10.1f %10.1f\n", asm_sizes[w],
+             asm_ns[w] * asm_sizes[w] / 1e6, asm_ns[w],
+             asm_bytes[w] / (asm_ns[w] * asm_sizes[w] / 1e3));
+    }
+  }
+
+  size_t dis_lines = 0;
+  double dis_us = run_dis(trial_s, &dis_lines);
+  if (!dis_us)
+    failed = 1;
+  printf("\n%-10s %12s %10s\n", "disasm", "us/64k", "ns/line");
+  printf("%-10s %12.1f %10.2f\n", "random", dis_us,
+         dis_us * 1e3 / dis_lines);
+
+  state_result_t states[2] = {{"image"}, {"noisy"}};
+  void (*series[2])(cpu_state_t *, int) = {next_image, next_noisy};
+  printf("\n%-10s %12s %10s %10s %10s\n", "states", "bytes/state",
+         "us/append", "us/load", "us/fread");
+  for (w = 0; w < 2; ++w) {
+    if (run_states(series[w], &states[w]) != 0) {
+      failed = 1;
+      continue;
+    }
+    printf("%-10s %12.0f %10.2f %10.2f %10.2f\n", states[w].name,
+           states[w].bytes_per_state, states[w].us_append, states[w].us_load,
+           states[w].us_fread);
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("peak rss: %ld KiB\n", ru.ru_maxrss);
+
+  FILE *f = fopen(json_path, "w");
+  if (!f) {
+    perror(json_path);
+    return 1;
+  }
+
+  fprintf(f, "{\n  \"rev\": \"%s\",\n  \"memo\": %s,\n"
+          "  \"peak_rss_kib\": %ld,\n  \"workloads\": [\n",
+          P64_REV, memo ? "true" : "false", ru.ru_maxrss);
+  const char *sep = "";
+  for (w = 0; w < NUM_WORKLOADS; ++w) {
+    if (!results[w].instructions)
+      continue;
+    fprintf(f, "%s    {\"name\": \"%s\", \"instructions\": %llu, "
+            "\"mips\": %.3f, \"ns_per_instr\": %.3f, \"us_per_run\": %.3f}",
+            sep, workloads[w].name,
+            (unsigned long long)results[w].instructions,
+            1e3 / results[w].ns_per_instr, results[w].ns_per_instr,
+            results[w].us_per_run);
+    sep = ",\n";
+  }
+  fprintf(f, "\n  ]");
+
+  if (!skip_asm) {
+    fprintf(f, ",\n  \"assembler\": [\n");
+    sep = "";
+    for (w = 0; w < NUM_ASM_SIZES; ++w) {
+      fprintf(f, "%s    {\"labels\": %zu, \"ns_per_label\": %.3f, "
+              "\"mb_per_s\": %.3f}", sep, asm_sizes[w], asm_ns[w],
+              asm_bytes[w] / (asm_ns[w] * asm_sizes[w] / 1e3));
+      sep = ",\n";
+    }
+    fprintf(f, "\n  ]");
+  }
+  fprintf(f, ",\n  \"disassembler\": {\"us_per_64k\": %.3f, "
+          "\"ns_per_line\": %.3f}", dis_us, dis_us * 1e3 / dis_lines);
+  fprintf(f, ",\n  \"save_states\": [\n");
+  sep = "";
+  for (w = 0; w < 2; ++w) {
+    fprintf(f, "%s    {\"name\": \"%s\", \"bytes_per_state\": %.1f, "
+            "\"us_append\": %.3f, \"us_load\": %.3f, \"us_fread\": %.3f}",
+            sep, states[w].name, states[w].bytes_per_state,
+            states[w].us_append, states[w].us_load, states[w].us_fread);
+    sep = ",\n";
+  }
+  fprintf(f, "\n  ]");
+  fprintf(f, "\n}\n");
+  fclose(f);
+
+  return failed;
+}
@@ -0,0 +1,575 @@
+#include "cfg.h"
+#include "asm.h"
+#include "dis.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NOTE_COL 34         /* where comments start in a listing */
+#define DATA_PER_LINE 8
+
+/* an analysis and what it was made from */
+typedef struct cached {
+  uint64_t hash;
+  uint16_t start;
+  uint32_t size;
+  uint8_t *image;           /* the bytes, unwrapped */
+  uint16_t *entries;
+  size_t num_entries;
+  cfg_t *cfg;
+  struct cached *next;
+} cached_t;
+
+static cached_t *cache;      /* most recently used first, evicted from the end */
+static size_t num_cached;
+static uint16_t sort_start;
+
+static int in_image(const cfg_t *cfg, uint16_t adr) {
+  return (uint16_t)(adr - cfg->start) < cfg->size;
+}
+
+static uint32_t offset(const cfg_t *cfg, uint16_t adr) {
+  return (uint16_t)(adr - cfg->start);
+}
+
+static void mark(cfg_t *cfg, uint16_t adr, uint8_t flags) {
+  if (in_image(cfg, adr))
+    cfg->map[adr] |= flags;
+}
+
+/* like dis_decode, but $00 is a one byte instruction */
+static int decode(const uint8_t *mem, uint16_t pc, dis_instr_t *in) {
+  dis_decode(mem, pc, in);
+  return (mem[pc] == 0 || in->name != NULL);
+}
+
+/*
+ * Follows every path from the addresses in work, marking the instructions
+ * on them. Each instruction is marked once and pushes at most one address,
+ * so work needs room for the entries and one per byte of the image.
+ */
+static void trace(cfg_t *cfg, const uint8_t *mem, uint16_t *work, size_t n) {
+  uint8_t *map = cfg->map;
+
+  while (n) {
+    uint16_t pc = work[--n];
+
+    while (in_image(cfg, pc) && !(map[pc] & CFG_CODE)) {
+      dis_instr_t in;
+      uint8_t op = mem[pc];
+      uint32_t i;
+
+      if (!decode(mem, pc, &in))
+        break;
+
+      /* running out of the image or into another instruction */
+      for (i = 0; i < in.len; ++i) {
+        uint16_t adr = pc + i;
+        if (!in_image(cfg, adr) || (map[adr] & (CFG_CODE | CFG_OPERAND)))
+          break;
+      }
+      if (i < in.len)
+        break;
+
+      map[pc] |= CFG_CODE;
+      for (i = 1; i < in.len; ++i)
+        map[(uint16_t)(pc + i)] |= CFG_OPERAND;
+      cfg->code_bytes += in.len;
+
+      if (op == 0 || op == 0x60 || op == 0x6C)    /* brk, rts, jmp (ind) */
+        break;
+
+      if (in.mode == ADR_REL) {
+        mark(cfg, in.val, CFG_JUMP | CFG_BLOCK);
+        mark(cfg, pc + 2, CFG_BLOCK);
+        work[n++] = in.val;
+      }
+      else if (op == 0x4C) {                      /* jmp */
+        mark(cfg, in.val, CFG_JUMP | CFG_BLOCK);
+        work[n++] = in.val;
+        break;
+      }
+      else if (op == 0x20) {                      /* jsr */
+        mark(cfg, in.val, CFG_SUB | CFG_BLOCK);
+        work[n++] = in.val;
+      }
+
+      pc += in.len;
+    }
+  }
+}
+
+/* operands that point at something other than code get a label too */
+static void find_refs(cfg_t *cfg, const uint8_t *mem) {
+  uint32_t o;
+  for (o = 0; o < cfg->size; ++o) {
+    uint16_t pc = cfg->start + o;
+    dis_instr_t in;
+
+    if (!(cfg->map[pc] & CFG_CODE))
+      continue;
+
+    dis_decode(mem, pc, &in);
+    if (in.mode != ADR_IMP && in.mode != ADR_IMM && in.mode != ADR_REL &&
+        in.op != 0x4C && in.op != 0x20)
+      mark(cfg, in.val, CFG_REF);
+  }
+}
+
+static void add_block(cfg_t *cfg, const cfg_block_t *block,
+                      size_t *max) {
+  if (cfg->num_blocks == *max) {
+    *max = (*max ? *max * 2 : 64);
+    cfg->blocks = realloc(cfg->blocks, *max * sizeof *cfg->blocks);
+  }
+
+  cfg->blocks[cfg->num_blocks++] = *block;
+}
+
+/* every instruction that the one before doesn't flow into starts a block,
+ * as does every jump target and what comes after a branch */
+static void find_blocks(cfg_t *cfg, const uint8_t *mem) {
+  uint8_t *map = cfg->map;
+  size_t max = 0, i;
+  uint32_t o = 0;
+
+  while (o < cfg->size) {
+    uint16_t pc = cfg->start + o;
+    cfg_block_t block = {pc, pc, 0, CFG_END_STOP, 0, {CFG_NONE, CFG_NONE}};
+
+    if (!(map[pc] & CFG_CODE)) {
+      o++;
+      continue;
+    }
+
+    map[pc] |= CFG_BLOCK;
+    while (1) {
+      dis_instr_t in;
+      decode(mem, pc, &in);
+      block.last = pc;
+      block.size += in.len;
+      o += in.len;
+      pc += in.len;
+
+      if (in.op == 0) {
+        block.end = CFG_END_BRK;
+        break;
+      }
+      if (in.op == 0x60) {
+        block.end = CFG_END_RTS;
+        break;
+      }
+      if (in.op == 0x6C) {
+        block.end = CFG_END_JMP_IND;
+        block.target = in.val;
+        break;
+      }
+      if (in.op == 0x4C || in.mode == ADR_REL) {
+        block.end = (in.op == 0x4C ? CFG_END_JMP : CFG_END_BRANCH);
+        block.target = in.val;
+        break;
+      }
+      if (o >= cfg->size || !(map[pc] & CFG_CODE))
+        break;
+      if (map[pc] & CFG_BLOCK) {
+        block.end = CFG_END_FALL;
+        break;
+      }
+    }
+
+    add_block(cfg, &block, &max);
+  }
+
+  for (i = 0; i < cfg->num_blocks; ++i) {
+    cfg_block_t *b = &cfg->blocks[i];
+    uint16_t after = b->start + b->size;
+
+    if (b->end == CFG_END_JMP || b->end == CFG_END_BRANCH)
+      b->next[0] = cfg_block_at(cfg, b->target);
+    if (b->end == CFG_END_FALL || b->end == CFG_END_BRANCH)
+      b->next[1] = cfg_block_at(cfg, after);
+  }
+}
+
+static int cmp_site(const void *a, const void *b) {
+  uint16_t sa = ((const cfg_call_t *)a)->site - sort_start;
+  uint16_t sb = ((const cfg_call_t *)b)->site - sort_start;
+  return (sa > sb) - (sa < sb);
+}
+
+/* the calls a subroutine makes are the jsrs in the blocks it can reach
+ * without calling anything */
+static void find_calls(cfg_t *cfg, const uint8_t *mem) {
+  uint32_t *seen = calloc(cfg->num_blocks, sizeof *seen);
+  uint32_t *stack = malloc(cfg->num_blocks * sizeof *stack);
+  size_t max_subs = 0, max_calls = 0, s;
+  uint32_t o;
+
+  for (o = 0; o < cfg->size; ++o) {
+    uint16_t pc = cfg->start + o;
+    if ((cfg->map[pc] & (CFG_CODE | CFG_SUB)) != (CFG_CODE | CFG_SUB))
+      continue;
+
+    if (cfg->num_subs == max_subs) {
+      max_subs = (max_subs ? max_subs * 2 : 16);
+      cfg->subs = realloc(cfg->subs, max_subs * sizeof *cfg->subs);
+    }
+    cfg->subs[cfg->num_subs].entry = pc;
+    cfg->subs[cfg->num_subs].block = cfg_block_at(cfg, pc);
+    cfg->num_subs++;
+  }
+
+  for (s = 0; s < cfg->num_subs; ++s) {
+    cfg_sub_t *sub = &cfg->subs[s];
+    size_t n = 0;
+
+    sub->first_call = cfg->num_calls;
+    stack[n++] = sub->block;
+    seen[sub->block] = s + 1;
+
+    while (n) {
+      const cfg_block_t *b = &cfg->blocks[stack[--n]];
+      int k;
+
+      for (o = 0; o < b->size; ) {
+        uint16_t pc = b->start + o;
+        dis_instr_t in;
+        decode(mem, pc, &in);
+        o += in.len;
+        if (in.op != 0x20)
+          continue;
+
+        if (cfg->num_calls == max_calls) {
+          max_calls = (max_calls ? max_calls * 2 : 64);
+          cfg->calls = realloc(cfg->calls, max_calls * sizeof *cfg->calls);
+        }
+        cfg_call_t *call = &cfg->calls[cfg->num_calls++];
+        call->caller = s;
+        call->callee = CFG_NONE;    /* once all subs are known */
+        call->site = pc;
+        call->target = in.val;
+      }
+
+      for (k = 0; k < 2; ++k) {
+        if (b->next[k] != CFG_NONE && seen[b->next[k]] != s + 1) {
+          seen[b->next[k]] = s + 1;
+          stack[n++] = b->next[k];
+        }
+      }
+    }
+
+    sub->num_calls = cfg->num_calls - sub->first_call;
+    sort_start = cfg->start;
+    if (sub->num_calls)
+      qsort(&cfg->calls[sub->first_call], sub->num_calls,
+            sizeof *cfg->calls, cmp_site);
+  }
+
+  for (s = 0; s < cfg->num_calls; ++s)
+    cfg->calls[s].callee = cfg_sub_at(cfg, cfg->calls[s].target);
+
+  free(seen);
+  free(stack);
+}
+
+static cfg_t *analyze(const uint8_t *mem, uint16_t start, uint32_t size,
+                      const uint16_t *entries, size_t num_entries) {
+  static const uint16_t vectors[] = {0xFFFA, 0xFFFC, 0xFFFE};
+  cfg_t *cfg = calloc(1, sizeof *cfg);
+  uint16_t *work = malloc((size + num_entries + 3) * sizeof *work);
+  size_t n = 0, i;
+
+  cfg->start = start;
+  cfg->size = size;
+
+  for (i = 0; i < num_entries; ++i) {
+    mark(cfg, entries[i], CFG_SUB | CFG_BLOCK);
+    work[n++] = entries[i];
+  }
+  for (i = 0; i < 3; ++i) {
+    if (!in_image(cfg, vectors[i]) || !in_image(cfg, vectors[i] + 1))
+      continue;
+
+    /* hi byte first, like jmp (ind) reads its pointer */
+    uint16_t adr = mem[vectors[i]] << 8 | mem[vectors[i] + 1];
+    mark(cfg, adr, CFG_SUB | CFG_BLOCK);
+    work[n++] = adr;
+  }
+
+  trace(cfg, mem, work, n);
+  find_refs(cfg, mem);
+  find_blocks(cfg, mem);
+  find_calls(cfg, mem);
+
+  free(work);
+  return cfg;
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *p, size_t n) {
+  while (n >= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+    p += 8;
+    n -= 8;
+  }
+  while (n--)
+    h = (h ^ *p++) * 0x100000001B3ull;
+
+  return h;
+}
+
+static void free_cached(cached_t *c) {
+  free(c->cfg->blocks);
+  free(c->cfg->subs);
+  free(c->cfg->calls);
+  free(c->cfg);
+  free(c->image);
+  free(c->entries);
+  free(c);
+}
+
+const cfg_t *cfg_analyze(const uint8_t *mem, uint16_t start, uint32_t size,
+                         const uint16_t *entries, size_t num_entries) {
+  if (size > MEM_MAX + 1)
+    size = MEM_MAX + 1;
+
+  /* the part before it wraps around */
+  uint32_t first = MEM_MAX + 1 - start;
+  if (first > size)
+    first = size;
+
+  uint64_t hash = 0xCBF29CE484222325ull;
+  hash = hash_bytes(hash, (const uint8_t *)&start, sizeof start);
+  hash = hash_bytes(hash, (const uint8_t *)&size, sizeof size);
+  hash = hash_bytes(hash, (const uint8_t *)entries,
+                    num_entries * sizeof *entries);
+  hash = hash_bytes(hash, &mem[start], first);
+  hash = hash_bytes(hash, mem, size - first);
+
+  cached_t *c, **link;
+  for (link = &cache; (c = *link) != NULL; link = &c->next) {
+    if (c->hash == hash && c->start == start && c->size == size &&
+        c->num_entries == num_entries &&
+        memcmp(c->entries, entries, num_entries * sizeof *entries) == 0 &&
+        memcmp(c->image, &mem[start], first) == 0 &&
+        memcmp(c->image + first, mem, size - first) == 0) {
+      *link = c->next;
+      c->next = cache;
+      cache = c;
+      return c->cfg;
+    }
+  }
+
+  if (num_cached == CFG_CACHE_ENTRIES) {
+    for (link = &cache; (*link)->next; link = &(*link)->next)
+      ;
+    free_cached(*link);
+    *link = NULL;
+    num_cached--;
+  }
+
+  c = malloc(sizeof *c);
+  c->hash = hash;
+  c->start = start;
+  c->size = size;
+  c->image = malloc(size);
+  memcpy(c->image, &mem[start], first);
+  memcpy(c->image + first, mem, size - first);
+  c->entries = malloc(num_entries * sizeof *entries + 1);
+  memcpy(c->entries, entries, num_entries * sizeof *entries);
+  c->num_entries = num_entries;
+  c->cfg = analyze(mem, start, size, entries, num_entries);
+  c->next = cache;
+  cache = c;
+  num_cached++;
+
+  return c->cfg;
+}
+
+void cfg_cache_clear(void) {
+  while (cache) {
+    cached_t *next = cache->next;
+    free_cached(cache);
+    cache = next;
+  }
+  num_cached = 0;
+}
+
+uint32_t cfg_block_at(const cfg_t *cfg, uint16_t adr) {
+  size_t lo = 0, hi = cfg->num_blocks;
+  uint32_t o = offset(cfg, adr);
+
+  if (!in_image(cfg, adr))
+    return CFG_NONE;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (offset(cfg, cfg->blocks[mid].start) < o)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < cfg->num_blocks && cfg->blocks[lo].start == adr ?
+          lo : CFG_NONE);
+}
+
+uint32_t cfg_sub_at(const cfg_t *cfg, uint16_t adr) {
+  size_t lo = 0, hi = cfg->num_subs;
+  uint32_t o = offset(cfg, adr);
+
+  if (!in_image(cfg, adr))
+    return CFG_NONE;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (offset(cfg, cfg->subs[mid].entry) < o)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < cfg->num_subs && cfg->subs[lo].entry == adr ? lo : CFG_NONE);
+}
+
+/* the first symbol at adr through the address sorted index */
+static sym_def_t *sym_at(struct symtab *syms, uint16_t adr) {
+  size_t lo = 0, hi = syms->num_symbols;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    sym_def_t *symdef = sym_by_address(syms, mid);
+    if (symdef && symdef->address < adr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  sym_def_t *symdef = sym_by_address(syms, lo);
+  return (symdef && symdef->address == adr ? symdef : NULL);
+}
+
+/* the symbol at adr, or a name for what the analysis found there. NULL
+ * if there's neither */
+static const char *label_at(const cfg_t *cfg, struct symtab *syms,
+                            uint16_t adr, char *buf) {
+  sym_def_t *symdef = (syms ? sym_at(syms, adr) : NULL);
+  if (symdef)
+    return symdef->id;
+
+  if (!in_image(cfg, adr))
+    return NULL;
+
+  uint8_t m = cfg->map[adr];
+  if (m & CFG_SUB)
+    sprintf(buf, "sub_%04X", adr);
+  else if (m & CFG_JUMP)
+    sprintf(buf, "l_%04X", adr);
+  else if (m & CFG_REF)
+    sprintf(buf, "d_%04X", adr);
+  else
+    return NULL;
+
+  return buf;
+}
+
+static void print_note(FILE *f, char *line, size_t len, const char *note) {
+  while (len < NOTE_COL)
+    line[len++] = ' ';
+  fprintf(f, "%.*s; %s\n", (int)len, line, note);
+}
+
+static void print_calls(FILE *f, const cfg_t *cfg, const cfg_sub_t *sub,
+                        struct symtab *syms) {
+  char name[16];
+  uint32_t i, j;
+
+  if (!sub->num_calls)
+    return;
+
+  fprintf(f, "; calls");
+  for (i = 0; i < sub->num_calls; ++i) {
+    const cfg_call_t *call = &cfg->calls[sub->first_call + i];
+
+    for (j = 0; j < i; ++j) {
+      if (cfg->calls[sub->first_call + j].target == call->target)
+        break;
+    }
+    if (j < i)
+      continue;
+
+    const char *label = label_at(cfg, syms, call->target, name);
+    if (label)
+      fprintf(f, " %s", label);
+    else
+      fprintf(f, " $%04X", call->target);
+  }
+  fprintf(f, "\n");
+}
+
+void cfg_print(FILE *f, const cfg_t *cfg, const uint8_t *mem,
+               struct symtab *syms) {
+  char line[DIS_LINE_MAX + NOTE_COL], name[16], note[16];
+  uint32_t o = 0;
+  int was_code = -1;
+
+  fprintf(f, "; $%04X-$%04X: %zu subroutines, %zu blocks, %zu of %u bytes "
+          "are code\n", cfg->start, (uint16_t)(cfg->start + cfg->size - 1),
+          cfg->num_subs, cfg->num_blocks, cfg->code_bytes,
+          (unsigned)cfg->size);
+
+  while (o < cfg->size) {
+    uint16_t pc = cfg->start + o;
+    uint8_t m = cfg->map[pc];
+    int is_code = (m & CFG_CODE) != 0;
+    const char *label = label_at(cfg, syms, pc, name);
+
+    if ((is_code && (m & CFG_SUB)) || is_code != was_code) {
+      fprintf(f, "\n");
+      if (is_code && (m & CFG_SUB))
+        print_calls(f, cfg, &cfg->subs[cfg_sub_at(cfg, pc)], syms);
+    }
+    was_code = is_code;
+    if (label)
+      fprintf(f, "%s\n", label);
+
+    if (is_code) {
+      dis_instr_t in;
+      dis_decode(mem, pc, &in);
+      size_t len = dis_line(mem, &in, line) - 1;
+      const char *target = NULL;
+
+      if (in.op == 0)
+        target = "brk";
+      else if (in.mode != ADR_IMP && in.mode != ADR_IMM)
+        target = label_at(cfg, syms, in.val, note);
+
+      if (target)
+        print_note(f, line, len, target);
+      else
+        fprintf(f, "%.*s\n", (int)len, line);
+
+      o += in.len;
+      continue;
+    }
+
+    /* data, up to the next label or code */
+    char text[DATA_PER_LINE + 1];
+    size_t len = sprintf(line, ".%04X  ", pc);
+    uint32_t n = 0;
+    do {
+      uint8_t c = mem[(uint16_t)(pc + n)];
+      len += sprintf(line + len, "%02X ", c);
+      text[n] = (c >= 0x20 && c < 0x7F ? c : '.');
+      n++;
+    } while (n < DATA_PER_LINE && o + n < cfg->size &&
+             !(cfg->map[(uint16_t)(pc + n)] & CFG_CODE) &&
+             !label_at(cfg, syms, pc + n, name));
+
+    text[n] = '\0';
+    print_note(f, line, len, text);
+    o += n;
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef P64_CFG_H
+#define P64_CFG_H
+
+/*
+ * Separates the code in an image from its data by following control flow
+ * from the entry points, the way the cpu would: branches go both ways, jmp
+ * goes to its target, jsr goes to its target and comes back after itself,
+ * rts, jmp (ind) and $00 end the path. Everything that isn't reached is
+ * data. The vectors at $FFFA-$FFFF (hi byte first, like every other
+ * pointer the emulator reads) are entry points too when the image covers
+ * them.
+ *
+ * The result is the basic blocks, the subroutines (entry points and jsr
+ * targets) and the calls between them. Analyses are cached by a hash of
+ * the image and the entry points, so analyzing the same image again costs
+ * the hash and a compare. The cache keeps the CFG_CACHE_ENTRIES images
+ * used last; an analysis is owned by it and stays valid until
+ * cfg_cache_clear or until that many other images have been analyzed
+ * since it was last asked for.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "6502.h"
+
+struct symtab;
+
+/* by address in cfg_t.map */
+#define CFG_CODE     0x01  /* an instruction starts here */
+#define CFG_OPERAND  0x02  /* inside an instruction */
+#define CFG_BLOCK    0x04  /* a basic block starts here */
+#define CFG_SUB      0x08  /* an entry point or jsr target */
+#define CFG_JUMP     0x10  /* a branch or jmp goes here */
+#define CFG_REF      0x20  /* some other operand points here */
+
+/* how a block ends */
+#define CFG_END_FALL     0  /* into the next block */
+#define CFG_END_BRANCH   1
+#define CFG_END_JMP      2
+#define CFG_END_JMP_IND  3  /* to somewhere that isn't known */
+#define CFG_END_RTS      4
+#define CFG_END_BRK      5  /* the $00 the machine stops at */
+#define CFG_END_STOP     6  /* runs into data or out of the image */
+
+#define CFG_NONE 0xFFFFFFFFu
+
+#define CFG_CACHE_ENTRIES 8
+
+typedef struct cfg_block {
+  uint16_t start;
+  uint16_t last;            /* its last instruction */
+  uint32_t size;            /* bytes */
+  uint8_t end;              /* CFG_END_x */
+  uint16_t target;          /* of the branch or jmp, also outside the image */
+  uint32_t next[2];         /* blocks: taken, fall through. or CFG_NONE */
+} cfg_block_t;
+
+typedef struct cfg_call {
+  uint32_t caller;          /* into subs */
+  uint32_t callee;          /* into subs, CFG_NONE outside the image */
+  uint16_t site;            /* the jsr */
+  uint16_t target;
+} cfg_call_t;
+
+typedef struct cfg_sub {
+  uint16_t entry;
+  uint32_t block;
+  uint32_t first_call, num_calls;  /* the calls it makes */
+} cfg_sub_t;
+
+typedef struct cfg {
+  uint16_t start;
+  uint32_t size;
+  uint8_t map[MEM_MAX + 1];   /* CFG_* by address, only in the image */
+  cfg_block_t *blocks;        /* in address order from start */
+  size_t num_blocks;
+  cfg_sub_t *subs;            /* in address order from start */
+  size_t num_subs;
+  cfg_call_t *calls;          /* by caller, then site */
+  size_t num_calls;
+  size_t code_bytes;
+} cfg_t;
+
+/* size bytes at start make up the image, they wrap around at $FFFF */
+const cfg_t *cfg_analyze(const uint8_t *mem, uint16_t start, uint32_t size,
+                         const uint16_t *entries, size_t num_entries);
+void cfg_cache_clear(void);
+
+/* the block starting at adr, CFG_NONE if there is none */
+uint32_t cfg_block_at(const cfg_t *, uint16_t adr);
+uint32_t cfg_sub_at(const cfg_t *, uint16_t adr);
+
+/* lists the image with code and data apart, labeled with the symbols in
+ * syms (which can be NULL) or made up names */
+void cfg_print(FILE *, const cfg_t *, const uint8_t *mem, struct symtab *);
+
+#endif /* !P64_CFG_H */
@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+#include "d64.h"
+#include "prg.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SECTOR_SIZE    256
+#define DIR_TRACK      18
+#define MAX_SECTORS    768   /* on 40 tracks */
+#define ENTRY_SIZE     32
+#define NAME_LEN       16
+#define PAD            0xA0  /* shifted space, fills out names */
+
+/* what the first read of a file found */
+typedef struct contents {
+  int state;                /* 0 not read yet, 1 read, -1 broken. set
+                               last, with release, under the lock */
+  int err;                  /* for -1 */
+  uint8_t *data;
+  size_t len;
+  prg_image_t prg;
+  int prg_err;              /* errno if it isn't a .prg that fits */
+} contents_t;
+
+struct d64 {
+  uint8_t *map;
+  size_t size;
+  int tracks;
+  char name[NAME_LEN + 1];
+  d64_file_t *files;        /* in directory order */
+  contents_t *contents;     /* by file */
+  size_t num_files;
+  uint32_t *slots;          /* file index + 1, by name hash */
+  size_t num_slots;         /* a power of 2 */
+  pthread_mutex_t lock;     /* held while contents are read the first time */
+};
+
+static int num_sectors(int track) {
+  return (track <= 17 ? 21 : track <= 24 ? 19 : track <= 30 ? 18 : 17);
+}
+
+/* counting from 1/0 */
+static uint32_t sector_index(int track, int sector) {
+  if (track <= 17)
+    return (track - 1) * 21 + sector;
+  if (track <= 24)
+    return 357 + (track - 18) * 19 + sector;
+  if (track <= 30)
+    return 490 + (track - 25) * 18 + sector;
+  return 598 + (track - 31) * 17 + sector;
+}
+
+/* NULL if the image doesn't have that sector */
+static const uint8_t *sector_at(const d64_t *d, int track, int sector) {
+  if (track < 1 || track > d->tracks || sector >= num_sectors(track))
+    return NULL;
+
+  return d->map + sector_index(track, sector) * SECTOR_SIZE;
+}
+
+/* a chain that comes back to a sector is broken */
+static int visit(uint8_t *seen, int track, int sector) {
+  uint32_t i = sector_index(track, sector);
+  if (seen[i / 8] & (1 << i % 8))
+    return -1;
+
+  seen[i / 8] |= 1 << i % 8;
+  return 0;
+}
+
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+  while (*name)
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  return hash;
+}
+
+static void copy_name(char *dst, const uint8_t *src) {
+  int i;
+  for (i = 0; i < NAME_LEN && src[i] != PAD; ++i)
+    dst[i] = src[i];
+  dst[i] = '\0';
+}
+
+/* the entries of the directory chain, up to where it breaks if it does */
+static void read_dir(d64_t *d) {
+  const uint8_t *bam = sector_at(d, DIR_TRACK, 0);
+  uint8_t seen[MAX_SECTORS / 8] = {0};
+  int track = bam[0], sector = bam[1];
+  size_t max = 0;
+
+  if (!track) {
+    track = DIR_TRACK;
+    sector = 1;
+  }
+
+  while (track) {
+    const uint8_t *sec = sector_at(d, track, sector);
+    int i;
+
+    if (!sec || visit(seen, track, sector) != 0)
+      break;
+
+    for (i = 0; i < SECTOR_SIZE / ENTRY_SIZE; ++i) {
+      const uint8_t *entry = sec + i * ENTRY_SIZE;
+      if (!entry[2])
+        continue;
+
+      if (d->num_files == max) {
+        max = (max ? max * 2 : 16);
+        d->files = realloc(d->files, max * sizeof *d->files);
+      }
+
+      d64_file_t *f = &d->files[d->num_files++];
+      copy_name(f->name, &entry[5]);
+      f->type = entry[2];
+      f->track = entry[3];
+      f->sector = entry[4];
+      f->blocks = entry[30] | entry[31] << 8;
+    }
+
+    track = sec[0];
+    sector = sec[1];
+  }
+}
+
+/* the first file with a name wins, like on the drive */
+static void build_index(d64_t *d) {
+  size_t i;
+
+  d->num_slots = 16;
+  while (d->num_slots < d->num_files * 2)
+    d->num_slots *= 2;
+  d->slots = calloc(d->num_slots, sizeof *d->slots);
+
+  for (i = 0; i < d->num_files; ++i) {
+    size_t slot = hash_name(d->files[i].name) & (d->num_slots - 1);
+    while (d->slots[slot] &&
+           strcmp(d->files[d->slots[slot] - 1].name, d->files[i].name) != 0)
+      slot = (slot + 1) & (d->num_slots - 1);
+
+    if (!d->slots[slot])
+      d->slots[slot] = i + 1;
+  }
+}
+
+d64_t *d64_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  int tracks = 0;
+  if (fstat(fd, &st) == 0) {
+    switch (st.st_size) {
+    case 683 * SECTOR_SIZE:
+    case 683 * (SECTOR_SIZE + 1): tracks = 35; break;
+    case 768 * SECTOR_SIZE:
+    case 768 * (SECTOR_SIZE + 1): tracks = 40; break;
+    }
+  }
+  if (!tracks) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  d64_t *d = calloc(1, sizeof *d);
+  d->map = map;
+  d->size = st.st_size;
+  d->tracks = tracks;
+  pthread_mutex_init(&d->lock, NULL);
+
+  copy_name(d->name, sector_at(d, DIR_TRACK, 0) + 0x90);
+  read_dir(d);
+  build_index(d);
+  d->contents = calloc(d->num_files + 1, sizeof *d->contents);
+  return d;
+}
+
+void d64_close(d64_t *d) {
+  size_t i;
+
+  if (!d)
+    return;
+
+  for (i = 0; i < d->num_files; ++i) {
+    free(d->contents[i].data);
+    prg_free(&d->contents[i].prg);
+  }
+  free(d->contents);
+  free(d->files);
+  free(d->slots);
+  pthread_mutex_destroy(&d->lock);
+  munmap(d->map, d->size);
+  free(d);
+}
+
+const char *d64_name(const d64_t *d) {
+  return d->name;
+}
+
+size_t d64_num_files(const d64_t *d) {
+  return d->num_files;
+}
+
+const d64_file_t *d64_file(const d64_t *d, size_t i) {
+  return (i < d->num_files ? &d->files[i] : NULL);
+}
+
+const d64_file_t *d64_find(const d64_t *d, const char *name) {
+  size_t i;
+
+  if (strcmp(name, "*") == 0) {
+    for (i = 0; i < d->num_files; ++i) {
+      if ((d->files[i].type & 0x07) == D64_PRG)
+        return &d->files[i];
+    }
+    return NULL;
+  }
+
+  size_t slot = hash_name(name) & (d->num_slots - 1);
+  while (d->slots[slot]) {
+    const d64_file_t *f = &d->files[d->slots[slot] - 1];
+    if (strcmp(f->name, name) == 0)
+      return f;
+    slot = (slot + 1) & (d->num_slots - 1);
+  }
+
+  return NULL;
+}
+
+/* the BAM only covers the first 35 tracks in the original format */
+unsigned d64_blocks_free(const d64_t *d) {
+  const uint8_t *bam = sector_at(d, DIR_TRACK, 0);
+  unsigned blocks = 0;
+  int track;
+
+  for (track = 1; track <= 35; ++track) {
+    if (track != DIR_TRACK)
+      blocks += bam[4 * track];
+  }
+
+  return blocks;
+}
+
+/* follows the sector chain twice, to size the file and then to copy it.
+ * the last sector says how much of it is used */
+static void read_contents(const d64_t *d, const d64_file_t *f,
+                          contents_t *c) {
+  int pass;
+
+  c->err = EINVAL;
+
+  for (pass = 0; pass < 2; ++pass) {
+    uint8_t seen[MAX_SECTORS / 8] = {0};
+    int track = f->track, sector = f->sector;
+    size_t len = 0;
+
+    while (1) {
+      const uint8_t *sec = sector_at(d, track, sector);
+      if (!sec || visit(seen, track, sector) != 0) {
+        __atomic_store_n(&c->state, -1, __ATOMIC_RELEASE);
+        return;
+      }
+
+      size_t used = (sec[0] ? SECTOR_SIZE - 2 : sec[1] > 1 ? sec[1] - 1 : 0);
+      if (pass)
+        memcpy(&c->data[len], &sec[2], used);
+      len += used;
+
+      if (!sec[0])
+        break;
+      track = sec[0];
+      sector = sec[1];
+    }
+
+    if (!pass) {
+      c->data = malloc(len + 1);
+      c->len = len;
+    }
+  }
+
+  c->prg_err = (prg_parse(&c->prg, c->data, c->len) == 0 ? 0 : errno);
+  __atomic_store_n(&c->state, 1, __ATOMIC_RELEASE);
+}
+
+const uint8_t *d64_read(d64_t *d, const d64_file_t *f, size_t *len) {
+  contents_t *c = &d->contents[f - d->files];
+  int state = __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+
+  /* only the first read of a file takes the lock, after that the
+   * contents don't change */
+  if (!state) {
+    pthread_mutex_lock(&d->lock);
+    if (!c->state)
+      read_contents(d, f, c);
+    state = c->state;
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  if (state < 0) {
+    errno = c->err;
+    return NULL;
+  }
+
+  *len = c->len;
+  return c->data;
+}
+
+int d64_load(d64_t *d, const char *name, cpu_state_t *cpu, uint16_t *start,
+             uint32_t *size) {
+  const d64_file_t *f = d64_find(d, name);
+  size_t len;
+
+  if (!f) {
+    errno = ENOENT;
+    return -1;
+  }
+  /* "FILE TYPE MISMATCH" on the drive */
+  if ((f->type & 0x07) != D64_PRG) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!d64_read(d, f, &len))
+    return -1;
+
+  const contents_t *c = &d->contents[f - d->files];
+  if (c->prg_err) {
+    errno = c->prg_err;
+    return -1;
+  }
+
+  prg_apply(&c->prg, cpu);
+  if (start)
+    *start = c->prg.segments[0].start;
+  if (size)
+    *size = c->prg.segments[0].size;
+  return 0;
+}
+
+void d64_print_dir(FILE *out, const d64_t *d) {
+  static const char *types[8] = {
+    "DEL", "SEQ", "PRG", "USR", "REL", "???", "???", "???"
+  };
+  const uint8_t *bam = sector_at(d, DIR_TRACK, 0);
+  size_t i;
+
+  fprintf(out, "0 \"%-16s\" %c%c %c%c\n", d->name, bam[0xA2], bam[0xA3],
+          bam[0xA5], bam[0xA6]);
+  for (i = 0; i < d->num_files; ++i) {
+    const d64_file_t *f = &d->files[i];
+    int pad = NAME_LEN - (int)strlen(f->name);
+
+    fprintf(out, "%-5u\"%s\"%*s %c%s%c\n", f->blocks, f->name, pad, "",
+            (f->type & D64_CLOSED ? ' ' : '*'), types[f->type & 0x07],
+            (f->type & D64_LOCKED ? '<' : ' '));
+  }
+  fprintf(out, "%u BLOCKS FREE.\n", d64_blocks_free(d));
+}
@@ -0,0 +1,63 @@
+#ifndef P64_D64_H
+#define P64_D64_H
+
+/*
+ * Reads files off 1541 disk images (.d64, 35 or 40 tracks, with or
+ * without error bytes).
+ *
+ * The image is mapped, the BAM and the directory are read once when it's
+ * opened and the file names go into a hash index. A file is put together
+ * from its sector chain the first time it's read and kept parsed as a
+ * .prg (see prg.h), so loading it again is a lookup and a memcpy. An open
+ * image can be used from any number of threads; only the first read of
+ * each file takes a lock.
+ *
+ * Names are compared byte for byte as PETSCII, which is ASCII for upper
+ * case letters, digits and most punctuation. "*" is the first PRG file,
+ * like LOAD"*",8.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "6502.h"
+
+#define D64_DEL      0
+#define D64_SEQ      1
+#define D64_PRG      2
+#define D64_USR      3
+#define D64_REL      4
+#define D64_LOCKED   0x40
+#define D64_CLOSED   0x80   /* not set for files left open, "splat" files */
+
+typedef struct d64_file {
+  char name[17];            /* padding removed, terminated */
+  uint8_t type;             /* D64_x and flags */
+  uint8_t track, sector;    /* where it starts */
+  uint16_t blocks;          /* as the directory says */
+} d64_file_t;
+
+typedef struct d64 d64_t;
+
+/* NULL with errno set if it can't be opened or isn't a disk image */
+d64_t *d64_open(const char *path);
+void d64_close(d64_t *);
+
+const char *d64_name(const d64_t *);
+size_t d64_num_files(const d64_t *);
+const d64_file_t *d64_file(const d64_t *, size_t i);
+const d64_file_t *d64_find(const d64_t *, const char *name);
+unsigned d64_blocks_free(const d64_t *);
+
+/* the contents of the file, valid until the image is closed. NULL with
+ * errno set if its sector chain is broken */
+const uint8_t *d64_read(d64_t *, const d64_file_t *, size_t *len);
+
+/* loads a PRG file like load_prg_range, other types fail with EINVAL */
+int d64_load(d64_t *, const char *name, cpu_state_t *, uint16_t *start,
+             uint32_t *size);
+
+/* like LOAD"$",8 and LIST */
+void d64_print_dir(FILE *, const d64_t *);
+
+#endif /* !P64_D64_H */
@@ -0,0 +1,179 @@
+#include "dis.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Everything about an opcode that doesn't depend on its operand is worked
+ * out once: its length, and the text after the bytes with room left for
+ * the operand's hex digits. A line is then a few fixed size copies.
+ */
+#define TAIL_MAX 12         /* "lda ($12),Y" and room to copy it whole */
+#define TEXT_COL 17         /* where the tail starts in a line */
+
+typedef struct dis_op {
+  char tail[TAIL_MAX];
+  uint8_t tail_len;
+  uint8_t hi_at, lo_at;     /* where the operand's digits go in tail, past
+                             * the newline when it doesn't have them */
+  uint8_t len;
+  uint8_t mode;
+  uint8_t shift;            /* of the two bytes after the opcode */
+  uint16_t mask;
+  uint16_t rel;             /* 0xFFFF for branches */
+  const char *name;
+} dis_op_t;
+
+static const struct {
+  const char *pre, *post;
+} mode_fmt[ADR_MAX] = {
+  [ADR_IMP] = {"",   ""},    [ADR_IMM] = {"#$", ""},
+  [ADR_ZP]  = {"$",  ""},    [ADR_ZPX] = {"$",  ",X"},
+  [ADR_ZPY] = {"$",  ",Y"},  [ADR_ABS] = {"$",  ""},
+  [ADR_ABX] = {"$",  ",X"},  [ADR_ABY] = {"$",  ",Y"},
+  [ADR_IZX] = {"($", ",X)"}, [ADR_IZY] = {"($", "),Y"},
+  [ADR_IND] = {"($", ")"},   [ADR_REL] = {"$",  ""},
+};
+
+static dis_op_t ops[0x100];
+static char hex2[0x100][2];
+
+__attribute__((constructor))
+static void build_dis_tables(void) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i;
+
+  for (i = 0; i < 0x100; ++i) {
+    hex2[i][0] = hex[i >> 4];
+    hex2[i][1] = hex[i & 0xF];
+  }
+
+  for (i = 0; i < 0x100; ++i) {
+    const opc_descr_t *desc = instr_descr(i);
+    dis_op_t *op = &ops[i];
+
+    op->hi_at = op->lo_at = TAIL_MAX;
+    if (!desc->cfun || !desc->name) {
+      memcpy(op->tail, "???", 3);
+      op->tail_len = 3;
+      op->len = 1;
+      op->mode = ADR_IMP;
+      continue;
+    }
+
+    op->name = desc->name;
+    op->mode = desc->addr_m;
+    op->len = instr_len(i);
+    if (op->mode == ADR_IMP) {
+      op->tail_len = sprintf(op->tail, "%s", desc->name);
+      continue;
+    }
+
+    int wide = (op->len == 3 || op->mode == ADR_REL);
+    uint8_t at = strlen(desc->name) + 1 + strlen(mode_fmt[op->mode].pre);
+    op->tail_len = sprintf(op->tail, "%s %s%s%s", desc->name,
+                           mode_fmt[op->mode].pre, (wide ? "0000" : "00"),
+                           mode_fmt[op->mode].post);
+    op->hi_at = (wide ? at : TAIL_MAX);
+    op->lo_at = (wide ? at + 2 : at);
+    op->shift = (op->len == 3 ? 0 : 8);
+    op->mask = (op->len == 3 ? 0xFFFF : 0xFF);
+    op->rel = (op->mode == ADR_REL ? 0xFFFF : 0);
+  }
+}
+
+/*
+ * Random bytes make every branch on the opcode a coin flip, so decoding
+ * and printing a line don't take any: the operand comes out of the tables
+ * and the parts of a line an opcode doesn't use are written anyway and
+ * covered up.
+ */
+static inline void decode(const uint8_t *mem, uint16_t pc,
+                          dis_instr_t *in) {
+  const dis_op_t *op = &ops[mem[pc]];
+  uint16_t word = mem[(uint16_t)(pc + 1)] << 8 | mem[(uint16_t)(pc + 2)];
+  uint16_t val = (word >> op->shift) & op->mask;
+
+  in->pc = pc;
+  in->op = mem[pc];
+  in->mode = op->mode;
+  in->len = op->len;
+  in->name = op->name;
+  /* a branch adds its sign extended offset to the next pc */
+  in->val = val + (op->rel & (uint16_t)(pc + 2 - ((val & 0x80) << 1)));
+}
+
+void dis_begin(dis_iter_t *it, const uint8_t *mem, uint16_t start,
+               uint32_t len) {
+  it->mem = mem;
+  it->pc = start;
+  it->left = len;
+}
+
+void dis_decode(const uint8_t *mem, uint16_t pc, dis_instr_t *in) {
+  decode(mem, pc, in);
+}
+
+static inline int next(dis_iter_t *it, dis_instr_t *in) {
+  if (!it->left)
+    return 0;
+
+  decode(it->mem, it->pc, in);
+  it->pc += in->len;
+  it->left -= (in->len < it->left ? in->len : it->left);
+  return 1;
+}
+
+int dis_next(dis_iter_t *it, dis_instr_t *in) {
+  return next(it, in);
+}
+
+static inline size_t line(const uint8_t *mem, const dis_instr_t *in,
+                          char *out) {
+  const dis_op_t *op = &ops[in->op];
+  char *tail = out + TEXT_COL;
+  int i;
+
+  out[0] = '.';
+  memcpy(out + 1, hex2[in->pc >> 8], 2);
+  memcpy(out + 3, hex2[in->pc & 0xFF], 2);
+  memcpy(out + 5, "  ", 2);
+  for (i = 0; i < 3; ++i) {
+    memcpy(out + 7 + 3 * i, hex2[mem[(uint16_t)(in->pc + i)]], 2);
+    out[9 + 3 * i] = ' ';
+  }
+  memcpy(out + 7 + 3 * in->len, "         ", 9);
+
+  memcpy(tail, op->tail, TAIL_MAX);
+  memcpy(tail + op->hi_at, hex2[in->val >> 8], 2);
+  memcpy(tail + op->lo_at, hex2[in->val & 0xFF], 2);
+  tail[op->tail_len] = '\n';
+  return TEXT_COL + op->tail_len + 1;
+}
+
+size_t dis_line(const uint8_t *mem, const dis_instr_t *in, char *out) {
+  return line(mem, in, out);
+}
+
+size_t dis_text(dis_iter_t *it, char *buf, size_t size) {
+  dis_iter_t at = *it;      /* a copy, so the text can't alias it */
+  char *p = buf;
+  dis_instr_t in;
+
+  while ((size_t)(p - buf) + DIS_LINE_MAX <= size && next(&at, &in))
+    p += line(at.mem, &in, p);
+
+  *it = at;
+  return p - buf;
+}
+
+/* prints the instructions at start_ofs, up to len bytes */
+void print_instr(uint8_t *mem, uint16_t len, uint16_t start_ofs) {
+  char buf[0x1000];
+  dis_iter_t it;
+  size_t n;
+
+  dis_begin(&it, mem, start_ofs, len);
+  while ((n = dis_text(&it, buf, sizeof buf)) != 0)
+    fwrite(buf, 1, n, stdout);
+}
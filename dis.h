@@ -0,0 +1,53 @@
+#ifndef P64_DIS_H
+#define P64_DIS_H
+
+/*
+ * Disassembler over a 64k memory image.
+ *
+ * dis_next decodes one instruction at a time into a dis_instr_t, for
+ * callers that want to look at the code rather than print it. dis_text
+ * writes listing lines into a buffer the caller owns, as many whole lines
+ * as fit, and can be called again with the same iterator for the rest.
+ * Lines look like
+ *
+ *   .0102  D0 FC            bne $0100
+ *
+ * with branches showing their target. Unknown opcodes are one byte, "???".
+ * Addresses wrap around at $FFFF like the cpu does.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "6502.h"
+
+#define DIS_LINE_MAX 32     /* longest line with its newline */
+
+typedef struct dis_instr {
+  uint16_t pc;
+  uint8_t op;
+  uint8_t mode;             /* ADR_x */
+  uint8_t len;              /* in bytes, 1 for unknown opcodes */
+  uint16_t val;             /* the operand, for branches the target */
+  const char *name;         /* NULL for unknown opcodes */
+} dis_instr_t;
+
+typedef struct dis_iter {
+  const uint8_t *mem;
+  uint16_t pc;
+  uint32_t left;            /* bytes, an instruction can run past them */
+} dis_iter_t;
+
+void dis_begin(dis_iter_t *, const uint8_t *mem, uint16_t start,
+               uint32_t len);
+void dis_decode(const uint8_t *mem, uint16_t pc, dis_instr_t *);
+int dis_next(dis_iter_t *, dis_instr_t *);
+
+/* writes one line, not terminated, and returns its length. out needs room
+ * for DIS_LINE_MAX chars */
+size_t dis_line(const uint8_t *mem, const dis_instr_t *, char *out);
+
+/* returns the number of chars written, 0 when the iterator is done or
+ * size is under DIS_LINE_MAX. the text isn't terminated */
+size_t dis_text(dis_iter_t *, char *buf, size_t size);
+
+#endif /* !P64_DIS_H */
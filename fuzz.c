@@ -0,0 +1,84 @@
+#include "fuzz.h"
+
+#include <string.h>
+
+/* when linked into libFuzzer the map is picked up as extra counters */
+#ifdef P64_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif
+uint8_t fuzz_cov[CPU_COV_SIZE];
+
+/* AFL hit count classes: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static uint8_t count_class(uint8_t n) {
+  if (n < 3)   return n;
+  if (n == 3)  return 4;
+  if (n < 8)   return 8;
+  if (n < 16)  return 16;
+  if (n < 32)  return 32;
+  if (n < 128) return 64;
+  return 128;
+}
+
+/* runs the target on one input, returns one of STOP_* */
+int fuzz_run(const fuzz_target_t *target, cpu_state_t *cpu,
+             const uint8_t *data, size_t size) {
+  if (size > target->input_max)
+    size = target->input_max;
+  if (size > MEM_MAX + 1u - target->input_adr)
+    size = MEM_MAX + 1u - target->input_adr;
+
+  memcpy(cpu, &target->snapshot, sizeof *cpu);
+  memcpy(&cpu->mem[target->input_adr], data, size);
+  cpu->a = size & 0xFF;
+  cpu->x = size >> 8;
+
+  memset(fuzz_cov, 0, sizeof fuzz_cov);
+  cpu_set_coverage(fuzz_cov);
+  int reason = run_machine_for(cpu, target->budget, NULL);
+  cpu_set_coverage(NULL);
+
+  return reason;
+}
+
+int fuzz_is_crash(int stop_reason) {
+  return (stop_reason == STOP_ILLEGAL || stop_reason == STOP_STACK);
+}
+
+/* virgin starts out as all 0xFF. returns 2 for a never seen edge, 1 for a
+ * new hit count on a known edge, 0 for nothing new */
+int fuzz_new_coverage(uint8_t *virgin) {
+  int ret = 0;
+  size_t i;
+
+  for (i = 0; i < CPU_COV_SIZE; ++i) {
+    /* the map is mostly zeroes, skip through it a word at a time */
+    if (!(i & 7)) {
+      uint64_t word;
+      memcpy(&word, &fuzz_cov[i], sizeof word);
+      if (!word) {
+        i += 7;
+        continue;
+      }
+    }
+
+    if (!fuzz_cov[i])
+      continue;
+
+    uint8_t cls = count_class(fuzz_cov[i]);
+    if (cls & virgin[i]) {
+      if (ret < 2)
+        ret = (virgin[i] == 0xFF ? 2 : 1);
+      virgin[i] &= ~cls;
+    }
+  }
+
+  return ret;
+}
+
+size_t fuzz_count_edges(const uint8_t *virgin) {
+  size_t n = 0, i;
+  for (i = 0; i < CPU_COV_SIZE; ++i)
+    n += (virgin[i] != 0xFF);
+
+  return n;
+}
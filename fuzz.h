@@ -0,0 +1,33 @@
+#ifndef P64_FUZZ_H
+#define P64_FUZZ_H
+
+/*
+ * In-process fuzzing of guest routines. Every run starts from the same
+ * prepared snapshot, gets the input written into a fixed memory region and
+ * runs for at most a given number of instructions. Branches, jumps and
+ * subroutine calls leave AFL style edge counts in fuzz_cov.
+ *
+ * The routine finds the input at input_adr with its length in a (lo) and
+ * x (hi).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "6502.h"
+
+typedef struct fuzz_target {
+  cpu_state_t snapshot;   /* where every run starts, including pc */
+  uint16_t input_adr;
+  uint16_t input_max;     /* longer inputs are truncated */
+  uint64_t budget;        /* instructions per run */
+} fuzz_target_t;
+
+extern uint8_t fuzz_cov[CPU_COV_SIZE];
+
+int fuzz_run(const fuzz_target_t *, cpu_state_t *cpu,
+             const uint8_t *data, size_t size);
+int fuzz_is_crash(int stop_reason);
+int fuzz_new_coverage(uint8_t *virgin);
+size_t fuzz_count_edges(const uint8_t *virgin);
+
+#endif /* !P64_FUZZ_H */
@@ -0,0 +1,144 @@
+#include "link.h"
+#include "asm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* where a symbol of the object ended up, place holds the address of every
+ * section of the object */
+static uint16_t sym_address(const obj_t *obj, const uint16_t *place,
+                            const obj_symbol_t *s) {
+  if (s->section == OBJ_ABSOLUTE)
+    return s->address;
+
+  return place[s->section] + (uint16_t)(s->address -
+                                        obj->sections[s->section].base);
+}
+
+int link_objects(const obj_t *objs, size_t num_objs, uint16_t base,
+                 struct cpu_state *image, uint16_t *start, uint32_t *size) {
+  size_t *first = malloc((num_objs + 1) * sizeof *first);
+  size_t num_secs = 0;
+  size_t o, i, j;
+
+  for (o = 0; o < num_objs; ++o) {
+    first[o] = num_secs;
+    num_secs += objs[o].hdr->num_sections;
+  }
+
+  uint16_t *place = malloc((num_secs + 1) * sizeof *place);
+  uint8_t *used = calloc(0x10000 / 8, 1);
+  symtab_t globals = {0};
+  uint32_t next = base, lo = 0x10000, hi = 0;
+  int ret = 0;
+
+  /* lay out the sections */
+  for (o = 0; o < num_objs; ++o) {
+    for (i = 0; i < objs[o].hdr->num_sections; ++i) {
+      const obj_section_t *sec = &objs[o].sections[i];
+      uint32_t adr = sec->base;
+
+      if (sec->flags & SECTION_RELOC) {
+        adr = next;
+        next += sec->size;
+      }
+
+      if (adr + sec->size > 0x10000) {
+        fprintf(stderr, "error: %s doesn't fit below $10000\n",
+                objs[o].path);
+        ret = -1;
+        goto out;
+      }
+
+      place[first[o] + i] = adr;
+    }
+  }
+
+  /* index the globals */
+  for (o = 0; o < num_objs; ++o) {
+    for (i = 0; i < objs[o].hdr->num_symbols; ++i) {
+      const obj_symbol_t *s = &objs[o].symbols[i];
+      const char *name = objs[o].names + s->name;
+
+      if (!(s->flags & SYM_GLOBAL) || (s->flags & SYM_UNDEFINED))
+        continue;
+
+      if (!sym_define(&globals, name,
+                      sym_address(&objs[o], &place[first[o]], s),
+                      SYM_GLOBAL)) {
+        fprintf(stderr, "error: global '%s' in %s is already defined\n",
+                name, objs[o].path);
+        ret = -1;
+      }
+    }
+  }
+
+  /* copy the code */
+  for (o = 0; o < num_objs; ++o) {
+    for (i = 0; i < objs[o].hdr->num_sections; ++i) {
+      const obj_section_t *sec = &objs[o].sections[i];
+      const uint8_t *data = objs[o].data + sec->data;
+      uint32_t adr = place[first[o] + i];
+
+      for (j = 0; j < sec->size; ++j, ++adr) {
+        if (used[adr >> 3] & (1 << (adr & 7))) {
+          fprintf(stderr, "error: %s overwrites $%04X\n", objs[o].path,
+                  adr);
+          ret = -1;
+          goto out;
+        }
+
+        used[adr >> 3] |= 1 << (adr & 7);
+        image->mem[adr] = data[j];
+      }
+
+      if (sec->size) {
+        if (place[first[o] + i] < lo)
+          lo = place[first[o] + i];
+        if (adr > hi)
+          hi = adr;
+      }
+    }
+  }
+
+  /* and patch the references */
+  for (o = 0; o < num_objs; ++o) {
+    for (i = 0; i < objs[o].hdr->num_relocs; ++i) {
+      const obj_reloc_t *r = &objs[o].relocs[i];
+      const obj_symbol_t *s = &objs[o].symbols[r->symbol];
+      const obj_section_t *sec = &objs[o].sections[r->section];
+      uint16_t pos = place[first[o] + r->section] + (uint16_t)(r->pos -
+                                                               sec->base);
+      uint16_t val;
+
+      if (s->flags & SYM_UNDEFINED) {
+        const char *name = objs[o].names + s->name;
+        sym_def_t *g = sym_lookup(&globals, name);
+        if (!g) {
+          fprintf(stderr, "error: symbol '%s' used by %s is not defined\n",
+                  name, objs[o].path);
+          ret = -1;
+          continue;
+        }
+        val = g->address;
+      }
+      else {
+        val = sym_address(&objs[o], &place[first[o]], s);
+      }
+
+      if (asm_patch(image->mem, pos, r->mode, val) != 0)
+        ret = -1;
+    }
+  }
+
+  *start = (lo < hi ? lo : 0);
+  *size = (lo < hi ? hi - lo : 0);
+
+out:
+  sym_clear(&globals);
+  free(first);
+  free(place);
+  free(used);
+  return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef P64_LINK_H
+#define P64_LINK_H
+
+/*
+ * Links objects into one image.
+ *
+ * The relocatable sections are laid out one after the other from base, in
+ * the order the objects are given; absolute sections stay where they were
+ * assembled. The global symbols of all objects go into one symtab, which
+ * the references each object leaves undefined are looked up in.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "6502.h"
+#include "obj.h"
+
+/* writes the linked code into image, returns -1 on errors. start and size
+ * get the range that was written */
+int link_objects(const obj_t *objs, size_t num_objs, uint16_t base,
+                 struct cpu_state *image, uint16_t *start, uint32_t *size);
+
+#endif /* !P64_LINK_H */
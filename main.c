@@ -1,33 +1,222 @@
+#define _POSIX_C_SOURCE 200809L
 #include "6502.h"
 #include "asm.h"
+#include "src.h"
+#include "cfg.h"
+#include "d64.h"
+#include "prg.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
 #include <ctype.h>
+#include <time.h>
 
-void repl() {
+#define REPL_BUDGET 10000000  /* instructions per run */
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void list_lines(src_t *src, size_t from, size_t count) {
+  size_t n;
+  for (n = from; n < src->num_lines && n < from + count; ++n) {
+    const src_line_t *l = src_line(src, n);
+    printf("%5zu  %04X  %s\n", n + 1, l->start, l->text);
+  }
+}
+
+/* runs a copy, so the program can be edited and run again */
+static void run_program(src_t *src, const char *from) {
+  static cpu_state_t cpu;
+  size_t i;
+
+  for (i = 0; i < src->sym.num_symbols; ++i) {
+    const sym_def_t *s = &src->sym.symbols[i];
+    if ((s->flags & SYM_UNDEFINED) && i < src->max_users && src->users[i])
+      printf("warning: '%s' isn't defined\n", s->id);
+  }
+
+  cpu = *src->cpu;
+  cpu.pc = 0;
+  for (i = 0; i < src->num_lines; ++i) {
+    if (src_line(src, i)->flags & ASM_LINE_INSTR) {
+      cpu.pc = src_line(src, i)->start;
+      break;
+    }
+  }
+
+  if (*from == '$') {
+    cpu.pc = strtol(from + 1, NULL, 16);
+  }
+  else if (*from) {
+    sym_def_t *s = sym_lookup(&src->sym, from);
+    if (!s) {
+      printf("'%s' isn't defined\n", from);
+      return;
+    }
+    cpu.pc = s->address;
+  }
+
+  uint64_t executed;
+  int reason = run_machine_for(&cpu, REPL_BUDGET, &executed);
+  printf("stopped (%d) after %llu instructions\n", reason,
+         (unsigned long long)executed);
+  print_state(&cpu);
+}
+
+/*
+ * Keeps the program as lines that can be changed and run again, only what
+ * a change affects is assembled or patched. A line is added at the end,
+ * commands start with ':' and take 1-based line numbers:
+ *   :e n text   changes line n    :i n text   inserts before line n
+ *   :d n        deletes line n    :l [n]      lists from line n
+ *   :r [label]  runs a copy       :q          quits
+ */
+void repl(const char *path) {
   static cpu_state_t cpu = {.ps = 0x20, .sp = 0xFF};
-  static symtab_t symbols;
-  char line[256];
+  src_t src;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
 
-  while (1) {
-    printf(".%04X: ", cpu.pc);
-    if (fgets(line, sizeof line, stdin)) {
-      parse_asm(line, &cpu, &symbols);
-      /* how about eval */
+  src_init(&src, &cpu);
+
+  if (path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+      perror(path);
+      return;
     }
-    else {
+
+    double t = now_us();
+    while ((len = getline(&line, &cap, f)) != -1) {
+      if (len > 0 && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+      src_insert(&src, src.num_lines, line);
+    }
+    fclose(f);
+    printf("%zu lines in %.0f us\n", src.num_lines, now_us() - t);
+  }
+
+  while (1) {
+    printf(".%04X: ", src_start(&src, src.num_lines));
+    if ((len = getline(&line, &cap, stdin)) == -1)
       break;
+    if (len > 0 && line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    char *text = line;
+    char cmd = 0;
+    size_t n = src.num_lines;
+    if (line[0] == ':') {
+      cmd = line[1];
+      n = strtoul(line + 2, &text, 10);
+      n = (n ? n - 1 : 0);
+      text += (*text == ' ');
+    }
+
+    src.assembled = src.patched = 0;
+    double t = now_us();
+
+    switch (cmd) {
+    case 0:   src_insert(&src, n, text); break;
+    case 'i': src_insert(&src, n, text); break;
+    case 'e': src_edit(&src, n, text); break;
+    case 'd': src_delete(&src, n); break;
+    case 'l': list_lines(&src, n, 20); continue;
+    case 'r': run_program(&src, line + 2 + strspn(line + 2, " ")); continue;
+    case 'q': goto out;
+    default:  printf("unknown command '%c'\n", cmd); continue;
     }
+
+    printf("%zu assembled, %zu patched in %.1f us\n", src.assembled,
+           src.patched, now_us() - t);
   }
 
-  print_state(&cpu);
-  print_instr(cpu.mem, 40, 0x100);
-  sym_clear(&symbols);
+out:
+  free(line);
+  src_free(&src);
 }
 
-int main() {
+#define MAX_ENTRIES 64
+
+/* lists memory loaded at start with its code and data told apart.
+ * arguments starting with $ are entry points besides start, another one
+ * is the source it was assembled from, for its labels */
+static int list_image(cpu_state_t *cpu, uint16_t start, uint32_t size,
+                      int argc, char **argv) {
+  static cpu_state_t scratch;
+  static symtab_t syms;
+  uint16_t entries[MAX_ENTRIES];
+  size_t num_entries = 0;
+  int i;
+
+  entries[num_entries++] = start;
+  for (i = 0; i < argc; ++i) {
+    if (argv[i][0] == '$' && num_entries < MAX_ENTRIES) {
+      entries[num_entries++] = strtoul(argv[i] + 1, NULL, 16);
+    }
+    else if (parse_asm_file(argv[i], &scratch, &syms) != 0) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+
+  const cfg_t *cfg = cfg_analyze(cpu->mem, start, size, entries, num_entries);
+  cfg_print(stdout, cfg, cpu->mem, &syms);
+  sym_clear(&syms);
+  return 0;
+}
+
+static int list_prg(int argc, char **argv) {
+  static cpu_state_t cpu;
+  uint16_t start;
+  uint32_t size;
+
+  if (load_prg_range(&cpu, argv[0], &start, &size) != 0) {
+    perror(argv[0]);
+    return 1;
+  }
+
+  return list_image(&cpu, start, size, argc - 1, argv + 1);
+}
+
+/* the directory of a disk image, or one of its files listed like a .prg */
+static int list_d64(int argc, char **argv) {
+  static cpu_state_t cpu;
+  uint16_t start;
+  uint32_t size;
+  int ret = 0;
+
+  d64_t *disk = d64_open(argv[0]);
+  if (!disk) {
+    perror(argv[0]);
+    return 1;
+  }
+
+  if (argc == 1) {
+    d64_print_dir(stdout, disk);
+  }
+  else if (d64_load(disk, argv[1], &cpu, &start, &size) != 0) {
+    perror(argv[1]);
+    ret = 1;
+  }
+  else {
+    ret = list_image(&cpu, start, size, argc - 2, argv + 2);
+  }
+
+  d64_close(disk);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  if (getenv("P64_STATS"))
+    stats_open();
+
   static cpu_state_t cpu = {
     .ps = 0x20,
     .sp = 0xFF,
@@ -59,11 +248,40 @@ int main() {
   static symtab_t object;
 
   /* TODO: replayability. record instructions, go back in time, etc.  */
-  
-  parse_asm(code, &cpu, &object);
+
+  /* -i [file] edits and runs the program interactively */
+  if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+    repl(argc > 2 ? argv[2] : NULL);
+    return 0;
+  }
+
+  /* -d file.prg [source] [$entry...] lists the code and data in a .prg */
+  if (argc > 2 && strcmp(argv[1], "-d") == 0)
+    return list_prg(argc - 2, argv + 2);
+
+  /* -D disk.d64 [name [source] [$entry...]] lists the directory of a disk
+   * image, or a file on it like -d */
+  if (argc > 2 && strcmp(argv[1], "-D") == 0)
+    return list_d64(argc - 2, argv + 2);
+
+  /* -O runs the peephole pass over what was assembled */
+  int arg = 1;
+  if (argc > arg && strcmp(argv[arg], "-O") == 0) {
+    object.flags |= ASM_OPTIMIZE;
+    arg++;
+  }
+
+  if (argc > arg) {
+    if (parse_asm_file(argv[arg], &cpu, &object) != 0) {
+      perror(argv[arg]);
+      return 1;
+    }
+  }
+  else {
+    parse_asm(code, &cpu, &object);
+  }
   print_state(&cpu);
   print_instr(cpu.mem, 40, 0x100);
-  /*  repl(); */
   return 0;
 }
 
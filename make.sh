@@ -1,3 +1,42 @@
 #!/bin/bash
-gcc -g main.c 6502.c asm.c prg.c -pedantic -Wall --std=c99
+# usage: ./make.sh [profile|stat|fuzz|bench|as|test]
+#   (default)  debug build, a.out
+#   profile    optimized build with per-opcode host cost instrumentation,
+#              prints a report to stderr at exit
+#   stat       p64stat, shows the live counters of running emulators
+#   fuzz       p64fuzz, in-process coverage guided fuzzer for guest code
+#   bench      p64bench, optimized throughput benchmarks, writes bench.json
+#   as         p64as, assembles modules into objects in parallel and links
+#              them into a .prg
+#   test       p64test, regression checks, and runs them
+SRC="main.c 6502.c asm.c opt.c src.c dis.c cfg.c prg.c d64.c stats.c"
+FLAGS="-pedantic -Wall --std=c99"
+LIBS="-lrt -pthread"
 
+case "$1" in
+  profile)
+    gcc -O2 -DNDEBUG -DP64_PROFILE $SRC prof.c $FLAGS -o p64-prof $LIBS
+    ;;
+  stat)
+    gcc -O2 p64stat.c $FLAGS -o p64stat $LIBS
+    ;;
+  fuzz)
+    gcc -O2 -DNDEBUG p64fuzz.c fuzz.c 6502.c prg.c stats.c $FLAGS -o p64fuzz $LIBS
+    ;;
+  bench)
+    REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+    gcc -O2 -DNDEBUG -DP64_REV="\"$REV\"" bench.c 6502.c asm.c opt.c dis.c prg.c state.c stats.c memo.c \
+        $FLAGS -o p64bench $LIBS
+    ;;
+  as)
+    gcc -O2 -DNDEBUG p64as.c obj.c link.c asm.c opt.c 6502.c prg.c stats.c \
+        $FLAGS -o p64as $LIBS
+    ;;
+  test)
+    gcc -O2 -DNDEBUG p64test.c 6502.c memo.c stats.c cfg.c dis.c asm.c opt.c $FLAGS -o p64test $LIBS &&
+      ./p64test
+    ;;
+  *)
+    gcc -g $SRC $FLAGS $LIBS
+    ;;
+esac
@@ -0,0 +1,504 @@
+#include "memo.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMO_TRACE_CALLS  4        /* default for memo_config_t */
+#define MEMO_MAX_READS    16
+#define MEMO_MAX_WRITES   16
+#define MEMO_MAX_CODE     1024     /* bytes of code a routine may span */
+#define MEMO_MAX_STEPS    100000   /* instructions per call */
+#define MEMO_ENTRIES      256      /* cached results per routine */
+#define MEMO_BUCKETS      256
+#define KEY_SIZE          (4 + MEMO_MAX_READS)
+
+/* what an instruction does besides changing registers */
+#define ACC_READ   0x01
+#define ACC_WRITE  0x02
+#define ACC_PULL   0x04
+#define ACC_BAIL   0x08  /* can't be memoized at all */
+#define ACC_PTR    0x10  /* through a pointer in zero page, (zp,x) (zp),y */
+
+#define REG_A   0x01
+#define REG_X   0x02
+#define REG_Y   0x04
+#define REG_PS  0x08
+
+enum { SUB_TRACING, SUB_PURE, SUB_IMPURE };
+
+typedef struct memo_entry {
+  uint8_t valid;
+  uint8_t key[KEY_SIZE];
+  uint8_t a, x, y, ps;
+  uint8_t regs;                     /* which registers the call set */
+  uint16_t written;                 /* which of the write slots */
+  uint8_t values[MEMO_MAX_WRITES];
+} memo_entry_t;
+
+typedef struct memo_sub {
+  uint16_t adr;
+  uint8_t state;
+  int traced;
+  uint16_t code_lo, code_hi;        /* inclusive */
+  uint8_t code[MEMO_MAX_CODE];      /* as it was when the cache filled */
+  uint16_t reads[MEMO_MAX_READS];
+  uint16_t writes[MEMO_MAX_WRITES];
+  size_t num_reads, num_writes;
+  uint8_t regs_in, regs_out;
+  memo_entry_t *entries;
+  struct memo_sub *next;
+} memo_sub_t;
+
+/* accesses made by one call */
+typedef struct trace {
+  uint16_t reads[MEMO_MAX_READS];
+  uint16_t writes[MEMO_MAX_WRITES];
+  size_t num_reads, num_writes;
+  uint8_t regs_in;                  /* read before being written */
+  uint8_t regs_out;
+  uint16_t code_lo, code_hi;
+  int ok;
+} trace_t;
+
+static memo_config_t config;
+static memo_stats_t stats;
+static memo_sub_t *buckets[MEMO_BUCKETS];
+static uint8_t access[0x100];
+static uint8_t reg_reads[0x100], reg_writes[0x100];
+
+/* flags are only ever partially updated, so setting them reads them too */
+static const struct {
+  const char *name;
+  uint8_t reads, writes;
+} reg_use[] = {
+  {"lda", REG_PS, REG_A|REG_PS},         {"ldx", REG_PS, REG_X|REG_PS},
+  {"ldy", REG_PS, REG_Y|REG_PS},         {"adc", REG_A|REG_PS, REG_A|REG_PS},
+  {"sbc", REG_A|REG_PS, REG_A|REG_PS},   {"and", REG_A|REG_PS, REG_A|REG_PS},
+  {"ora", REG_A|REG_PS, REG_A|REG_PS},   {"eor", REG_A|REG_PS, REG_A|REG_PS},
+  {"cmp", REG_A|REG_PS, REG_PS},         {"sta", REG_A, 0},
+  {"stx", REG_X, 0},                     {"sty", REG_Y, 0},
+  {"inc", REG_PS, REG_PS},               {"dec", REG_PS, REG_PS},
+  {"inx", REG_X|REG_PS, REG_X|REG_PS},   {"dex", REG_X|REG_PS, REG_X|REG_PS},
+  {"iny", REG_Y|REG_PS, REG_Y|REG_PS},   {"dey", REG_Y|REG_PS, REG_Y|REG_PS},
+  {"tax", REG_A|REG_PS, REG_X|REG_PS},   {"tay", REG_A|REG_PS, REG_Y|REG_PS},
+  {"txa", REG_X|REG_PS, REG_A|REG_PS},   {"tya", REG_Y|REG_PS, REG_A|REG_PS},
+  {"pha", REG_A, 0},                     {"php", REG_PS, 0},
+  {"pla", REG_PS, REG_A|REG_PS},         {"plp", 0, REG_PS},
+  {"clc", REG_PS, REG_PS},               {"sec", REG_PS, REG_PS},
+  {"cli", REG_PS, REG_PS},               {"sei", REG_PS, REG_PS},
+  {"cld", REG_PS, REG_PS},               {"sed", REG_PS, REG_PS},
+  {"clv", REG_PS, REG_PS},               {"bpl", REG_PS, 0},
+  {"bmi", REG_PS, 0},                    {"bvc", REG_PS, 0},
+  {"bvs", REG_PS, 0},                    {"bcc", REG_PS, 0},
+  {"bcs", REG_PS, 0},                    {"bne", REG_PS, 0},
+  {"beq", REG_PS, 0}
+};
+
+static int in_list(const uint16_t *list, size_t n, uint16_t adr) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    if (list[i] == adr)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* adds adr to the list unless it's there, returns -1 if it's full */
+static int add_to_list(uint16_t *list, size_t *n, size_t max, uint16_t adr) {
+  if (in_list(list, *n, adr))
+    return 0;
+  if (*n == max)
+    return -1;
+
+  list[(*n)++] = adr;
+  return 0;
+}
+
+static void build_access_table(void) {
+  static const char *reads[] = {
+    "lda", "ldx", "ldy", "adc", "sbc", "and", "ora", "eor", "cmp"
+  };
+  static const char *writes[] = {"sta", "stx", "sty"};
+  static const char *rmw[] = {"inc", "dec"};
+  static const char *pulls[] = {"pla", "plp", "rts"};
+  size_t opc, i;
+
+  for (opc = 0; opc < 0x100; ++opc) {
+    const opc_descr_t *d = instr_descr(opc);
+    uint8_t acc = 0;
+
+    access[opc] = reg_reads[opc] = reg_writes[opc] = 0;
+    if (!d->name)
+      continue;
+
+    for (i = 0; i < sizeof reg_use / sizeof reg_use[0]; ++i) {
+      if (strcmp(d->name, reg_use[i].name) == 0) {
+        reg_reads[opc] = reg_use[i].reads;
+        reg_writes[opc] = reg_use[i].writes;
+      }
+    }
+
+    switch (d->addr_m) {
+    case ADR_ZPX: case ADR_ABX: case ADR_IZX: reg_reads[opc] |= REG_X; break;
+    case ADR_ZPY: case ADR_ABY: case ADR_IZY: reg_reads[opc] |= REG_Y; break;
+    }
+
+    int mem = (d->addr_m != ADR_IMP && d->addr_m != ADR_IMM &&
+               d->addr_m != ADR_REL);
+
+    for (i = 0; i < sizeof reads / sizeof reads[0]; ++i)
+      if (mem && strcmp(d->name, reads[i]) == 0) acc |= ACC_READ;
+    for (i = 0; i < sizeof writes / sizeof writes[0]; ++i)
+      if (mem && strcmp(d->name, writes[i]) == 0) acc |= ACC_WRITE;
+    for (i = 0; i < sizeof rmw / sizeof rmw[0]; ++i)
+      if (mem && strcmp(d->name, rmw[i]) == 0) acc |= ACC_READ | ACC_WRITE;
+    for (i = 0; i < sizeof pulls / sizeof pulls[0]; ++i)
+      if (strcmp(d->name, pulls[i]) == 0) acc |= ACC_PULL;
+
+    /* indirect jumps read a pointer, tsx/txs depend on where the caller's
+     * stack is */
+    if ((strcmp(d->name, "jmp") == 0 && d->addr_m == ADR_IND) ||
+        strcmp(d->name, "tsx") == 0 || strcmp(d->name, "txs") == 0)
+      acc |= ACC_BAIL;
+
+    if (acc & (ACC_READ | ACC_WRITE) &&
+        (d->addr_m == ADR_IZX || d->addr_m == ADR_IZY))
+      acc |= ACC_PTR;
+
+    access[opc] = acc;
+  }
+}
+
+/* runs the jsr at pc until its rts, recording what it touches, for at
+ * most max_steps instructions. the cpu state is exact whatever happens;
+ * t->ok says if the call was pure. returns the number of instructions
+ * executed */
+static uint64_t trace_call(cpu_state_t *cpu, trace_t *t, uint64_t max_steps) {
+  uint8_t s = cpu->sp;
+  uint16_t ret_pc = cpu->pc + 3;
+  uint64_t steps = 0;
+  int returned = 0;
+
+  t->num_reads = t->num_writes = 0;
+  t->regs_in = t->regs_out = 0;
+  t->code_lo = 0xFFFF;
+  t->code_hi = 0;
+  t->ok = 0;
+
+  if (step_machine(cpu) != STOP_NONE)
+    return 0;
+  steps++;
+
+  while (steps < max_steps) {
+    uint16_t pc = cpu->pc;
+    uint8_t opc = cpu->mem[pc];
+    uint8_t acc = access[opc];
+    unsigned end = pc + instr_len(opc) - 1;
+
+    if (end > MEM_MAX || (acc & ACC_BAIL))
+      return steps;
+
+    t->regs_in |= reg_reads[opc] & ~t->regs_out;
+    t->regs_out |= reg_writes[opc];
+
+    if (pc < t->code_lo) t->code_lo = pc;
+    if (end > t->code_hi) t->code_hi = end;
+    if (t->code_hi - t->code_lo >= MEMO_MAX_CODE)
+      return steps;
+
+    /* the pointer decides where the access goes, so it's an input too */
+    if (acc & ACC_PTR) {
+      uint8_t zp = cpu->mem[(uint16_t)(pc + 1)];
+      if (instr_descr(opc)->addr_m == ADR_IZX)
+        zp += cpu->x;
+      if (!in_list(t->writes, t->num_writes, zp) &&
+          add_to_list(t->reads, &t->num_reads, MEMO_MAX_READS, zp) != 0)
+        return steps;
+      zp++;
+      if (!in_list(t->writes, t->num_writes, zp) &&
+          add_to_list(t->reads, &t->num_reads, MEMO_MAX_READS, zp) != 0)
+        return steps;
+    }
+
+    if (acc & (ACC_READ | ACC_WRITE)) {
+      uint16_t adr = instr_adr(cpu);
+      if (adr >= config.io_lo && adr <= config.io_hi)
+        return steps;
+
+      /* reading back what the call itself wrote isn't an input */
+      if ((acc & ACC_READ) && !in_list(t->writes, t->num_writes, adr) &&
+          add_to_list(t->reads, &t->num_reads, MEMO_MAX_READS, adr) != 0)
+        return steps;
+
+      if (acc & ACC_WRITE) {
+        if (adr == 0x100 + s || adr == 0xFF + s)  /* the return address */
+          return steps;
+        if (add_to_list(t->writes, &t->num_writes, MEMO_MAX_WRITES, adr) != 0)
+          return steps;
+      }
+    }
+
+    if (acc & ACC_PULL) {
+      if (opc == 0x60 && cpu->sp == (uint8_t)(s - 2)) {
+        /* our own rts */
+        step_machine(cpu);
+        steps++;
+        returned = 1;
+        break;
+      }
+
+      /* everything from the return address up belongs to the caller */
+      if (cpu->sp + (opc == 0x60 ? 2 : 1) >= s - 1)
+        return steps;
+    }
+
+    if (step_machine(cpu) != STOP_NONE)
+      return steps;
+    steps++;
+  }
+
+  if (!returned || cpu->pc != ret_pc)
+    return steps;
+
+  /* self-modifying code */
+  size_t i;
+  for (i = 0; i < t->num_writes; ++i) {
+    if (t->writes[i] >= t->code_lo && t->writes[i] <= t->code_hi)
+      return steps;
+  }
+
+  t->ok = 1;
+  return steps;
+}
+
+static memo_sub_t *find_sub(uint16_t adr) {
+  memo_sub_t **head = &buckets[(adr ^ adr >> 8) % MEMO_BUCKETS];
+  memo_sub_t *sub;
+
+  for (sub = *head; sub; sub = sub->next) {
+    if (sub->adr == adr)
+      return sub;
+  }
+
+  sub = calloc(1, sizeof *sub);
+  sub->adr = adr;
+  sub->state = SUB_TRACING;
+  sub->code_lo = 0xFFFF;
+  sub->next = *head;
+  *head = sub;
+  return sub;
+}
+
+static void make_impure(memo_sub_t *sub) {
+  if (sub->state == SUB_PURE)
+    stats.pure--;
+  sub->state = SUB_IMPURE;
+  stats.impure++;
+  free(sub->entries);
+  sub->entries = NULL;
+}
+
+/* grows the routine's read, write and code sets by what the call did.
+ * cached entries stay valid: they didn't depend on anything new */
+static int merge_trace(cpu_state_t *cpu, memo_sub_t *sub, const trace_t *t) {
+  size_t i;
+
+  sub->regs_in |= t->regs_in;
+  sub->regs_out |= t->regs_out;
+
+  for (i = 0; i < t->num_reads; ++i) {
+    if (add_to_list(sub->reads, &sub->num_reads, MEMO_MAX_READS,
+                    t->reads[i]) != 0)
+      return -1;
+  }
+
+  for (i = 0; i < t->num_writes; ++i) {
+    if (add_to_list(sub->writes, &sub->num_writes, MEMO_MAX_WRITES,
+                    t->writes[i]) != 0)
+      return -1;
+  }
+
+  if (t->code_lo < sub->code_lo || t->code_hi > sub->code_hi) {
+    uint16_t lo = (t->code_lo < sub->code_lo ? t->code_lo : sub->code_lo);
+    uint16_t hi = (t->code_hi > sub->code_hi ? t->code_hi : sub->code_hi);
+    if (hi - lo >= MEMO_MAX_CODE)
+      return -1;
+
+    sub->code_lo = lo;
+    sub->code_hi = hi;
+    memcpy(sub->code, &cpu->mem[lo], hi - lo + 1);
+  }
+
+  return 0;
+}
+
+static size_t make_key(const cpu_state_t *cpu, const memo_sub_t *sub,
+                       uint8_t *key) {
+  size_t i;
+
+  key[0] = (sub->regs_in & REG_A ? cpu->a : 0);
+  key[1] = (sub->regs_in & REG_X ? cpu->x : 0);
+  key[2] = (sub->regs_in & REG_Y ? cpu->y : 0);
+  key[3] = (sub->regs_in & REG_PS ? cpu->ps : 0);
+  for (i = 0; i < sub->num_reads; ++i)
+    key[4 + i] = cpu->mem[sub->reads[i]];
+  for (; i < MEMO_MAX_READS; ++i)
+    key[4 + i] = 0;
+
+  return 4 + sub->num_reads;
+}
+
+static uint32_t hash_key(const uint8_t *key, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = (h ^ key[i]) * 16777619u;
+
+  return h;
+}
+
+static uint64_t memo_jsr(cpu_state_t *cpu, uint64_t budget) {
+  uint16_t target = (cpu->mem[(uint16_t)(cpu->pc + 1)] << 8 |
+                     cpu->mem[(uint16_t)(cpu->pc + 2)]);
+  memo_sub_t *sub = find_sub(target);
+  uint8_t key[KEY_SIZE];
+  memo_entry_t *entry = NULL;
+
+  stats.calls++;
+
+  if (sub->state == SUB_IMPURE) {
+    stats.uncached++;
+    return 0;
+  }
+
+  if (sub->state == SUB_PURE) {
+    if (memcmp(sub->code, &cpu->mem[sub->code_lo],
+               sub->code_hi - sub->code_lo + 1) != 0) {
+      /* the code changed under us, start over */
+      stats.invalidations++;
+      stats.pure--;
+      free(sub->entries);
+      sub->entries = NULL;
+      sub->state = SUB_TRACING;
+      sub->traced = 0;
+      sub->num_reads = sub->num_writes = 0;
+      sub->code_lo = 0xFFFF;
+      sub->code_hi = 0;
+    }
+    else {
+      size_t len = make_key(cpu, sub, key);
+      entry = &sub->entries[hash_key(key, len) % MEMO_ENTRIES];
+
+      if (entry->valid && memcmp(entry->key, key, KEY_SIZE) == 0) {
+        size_t i;
+        if (entry->regs & REG_A)  cpu->a = entry->a;
+        if (entry->regs & REG_X)  cpu->x = entry->x;
+        if (entry->regs & REG_Y)  cpu->y = entry->y;
+        if (entry->regs & REG_PS) cpu->ps = entry->ps;
+        for (i = 0; i < sub->num_writes; ++i) {
+          if (entry->written & (1 << i))
+            cpu->mem[sub->writes[i]] = entry->values[i];
+        }
+        cpu->pc += 3;
+        stats.hits++;
+        return 1;
+      }
+    }
+  }
+
+  trace_t t;
+  uint64_t max_steps = (budget && budget < MEMO_MAX_STEPS ?
+                        budget : MEMO_MAX_STEPS);
+  uint64_t steps = trace_call(cpu, &t, max_steps);
+  size_t known_reads = sub->num_reads;
+  uint8_t known_regs = sub->regs_in;
+
+  /* the budget ran out before the call was over, that says nothing */
+  if (!t.ok && budget && steps >= budget)
+    return steps;
+  if (!t.ok || merge_trace(cpu, sub, &t) != 0) {
+    make_impure(sub);
+    return steps;
+  }
+
+  if (sub->state == SUB_TRACING) {
+    stats.traced++;
+    if (++sub->traced >= config.trace_calls) {
+      sub->entries = calloc(MEMO_ENTRIES, sizeof *sub->entries);
+      sub->state = SUB_PURE;
+      stats.pure++;
+    }
+
+    return steps;
+  }
+
+  /* a pure routine that missed. the key was taken before it ran, so it's
+   * only good if the call didn't depend on anything new */
+  if (sub->num_reads != known_reads || sub->regs_in != known_regs)
+    return steps;
+
+  size_t i;
+  entry->valid = 1;
+  memcpy(entry->key, key, KEY_SIZE);
+  entry->a = cpu->a;
+  entry->x = cpu->x;
+  entry->y = cpu->y;
+  entry->ps = cpu->ps;
+  entry->regs = t.regs_out;
+  entry->written = 0;
+  for (i = 0; i < sub->num_writes; ++i) {
+    if (in_list(t.writes, t.num_writes, sub->writes[i])) {
+      entry->written |= 1 << i;
+      entry->values[i] = cpu->mem[sub->writes[i]];
+    }
+  }
+
+  stats.misses++;
+  return steps;
+}
+
+void memo_enable(const memo_config_t *cfg) {
+  memo_disable();
+
+  config = *cfg;
+  if (config.trace_calls <= 0)
+    config.trace_calls = MEMO_TRACE_CALLS;
+
+  build_access_table();
+  cpu_set_jsr_hook(memo_jsr);
+}
+
+void memo_disable(void) {
+  size_t i;
+
+  cpu_set_jsr_hook(NULL);
+  for (i = 0; i < MEMO_BUCKETS; ++i) {
+    while (buckets[i]) {
+      memo_sub_t *next = buckets[i]->next;
+      free(buckets[i]->entries);
+      free(buckets[i]);
+      buckets[i] = next;
+    }
+  }
+
+  memset(&stats, 0, sizeof stats);
+}
+
+void memo_get_stats(memo_stats_t *out) {
+  *out = stats;
+}
+
+void memo_print_stats(FILE *f) {
+  fprintf(f, "memo: %llu calls, %llu hits (%.1f%%), %llu misses, "
+          "%llu traced, %llu uncached, %llu invalidations; "
+          "%u pure, %u impure routines\n",
+          (unsigned long long)stats.calls,
+          (unsigned long long)stats.hits,
+          stats.calls ? 100.0 * stats.hits / stats.calls : 0.0,
+          (unsigned long long)stats.misses,
+          (unsigned long long)stats.traced,
+          (unsigned long long)stats.uncached,
+          (unsigned long long)stats.invalidations,
+          stats.pure, stats.impure);
+}
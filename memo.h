@@ -0,0 +1,43 @@
+#ifndef P64_MEMO_H
+#define P64_MEMO_H
+
+/*
+ * Opt-in memoization of pure guest subroutines.
+ *
+ * The first few calls to every jsr target are traced to find the memory
+ * the routine reads and writes. A routine that stays within a small read
+ * and write set, doesn't touch the I/O range, leaves the caller's stack
+ * alone and returns through its own rts is considered pure. After that,
+ * calls are looked up by a, x, y, ps and the bytes in the read set; a hit
+ * applies the cached registers and memory writes and continues after the
+ * jsr without running the routine.
+ *
+ * The bytes the routine pushes below its own stack frame are not written
+ * on a hit. A change to the routine's code drops its cache.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "6502.h"
+
+typedef struct memo_config {
+  uint16_t io_lo, io_hi;  /* accesses in here are impure, none if lo > hi */
+  int trace_calls;        /* calls traced before caching, 0 for default */
+} memo_config_t;
+
+typedef struct memo_stats {
+  uint64_t calls;         /* jsrs seen */
+  uint64_t hits;
+  uint64_t misses;        /* pure routine, executed and cached */
+  uint64_t traced;
+  uint64_t uncached;      /* calls to impure routines */
+  uint64_t invalidations; /* caches dropped because code changed */
+  uint32_t pure, impure;  /* routines */
+} memo_stats_t;
+
+void memo_enable(const memo_config_t *);
+void memo_disable(void);
+void memo_get_stats(memo_stats_t *);
+void memo_print_stats(FILE *);
+
+#endif /* !P64_MEMO_H */
@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+#include "obj.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN4(n) (((n) + 3) & ~(size_t)3)
+
+/* the object section holding the address, -1 if none */
+static int find_section(const obj_section_t *secs, size_t num, uint16_t adr) {
+  size_t i;
+  for (i = 0; i < num; ++i) {
+    if (adr >= secs[i].base && adr - secs[i].base < secs[i].size)
+      return i;
+  }
+
+  return -1;
+}
+
+/*
+ * Writes what was assembled into cpu and sym as an object. References to
+ * symbols with a fixed address are patched in place, everything else
+ * becomes a relocation. The file is written next to path and renamed over
+ * it, so a reader never sees half an object.
+ */
+int obj_write(const char *path, struct cpu_state *cpu, struct symtab *sym) {
+  obj_header_t hdr = {{0}};
+  obj_section_t *secs = calloc(sym->num_sections + 1, sizeof *secs);
+  obj_symbol_t *syms = calloc(sym->num_symbols + 1, sizeof *syms);
+  obj_reloc_t *relocs = calloc(sym->num_fixups + 1, sizeof *relocs);
+  char *names = NULL;
+  uint8_t *data = NULL;
+  int ret = -1;
+  size_t i, j;
+
+  /* empty sections are dropped, except the relocatable one that labels
+   * can still point into */
+  for (i = 0; i < sym->num_sections; ++i) {
+    const asm_section_t *sec = &sym->sections[i];
+    if (!sec->size && !(sec->flags & SECTION_RELOC))
+      continue;
+
+    secs[hdr.num_sections].data = hdr.data_size;
+    secs[hdr.num_sections].size = sec->size;
+    secs[hdr.num_sections].base = sec->base;
+    secs[hdr.num_sections].flags = sec->flags;
+    hdr.num_sections++;
+    hdr.data_size += ALIGN4(sec->size);
+  }
+
+  /* they all share the module's 64K, so they can't overlap */
+  for (i = 0; i < hdr.num_sections; ++i) {
+    for (j = 0; j < i; ++j) {
+      if (secs[i].base < secs[j].base + secs[j].size &&
+          secs[j].base < secs[i].base + secs[i].size) {
+        fprintf(stderr, "error: sections at $%04X and $%04X overlap\n",
+                secs[j].base, secs[i].base);
+        goto out;
+      }
+    }
+  }
+
+  /* relocatable symbols are in the one relocatable section */
+  int reloc_sec = -1;
+  for (i = 0; i < hdr.num_sections; ++i) {
+    if (secs[i].flags & SECTION_RELOC)
+      reloc_sec = i;
+  }
+
+  for (i = 0; i < sym->num_symbols; ++i)
+    hdr.names_size += strlen(sym->symbols[i].id) + 1;
+  hdr.names_size = ALIGN4(hdr.names_size);
+
+  names = calloc(hdr.names_size + 1, 1);
+  data = calloc(hdr.data_size + 1, 1);
+
+  uint32_t name_ofs = 0;
+  for (i = 0; i < sym->num_symbols; ++i) {
+    const sym_def_t *s = &sym->symbols[i];
+    obj_symbol_t *os = &syms[i];
+    os->name = name_ofs;
+    os->address = s->address;
+    os->flags = s->flags;
+    os->section = OBJ_ABSOLUTE;
+    if (s->flags & SYM_RELOC)
+      os->section = reloc_sec;
+
+    strcpy(names + name_ofs, s->id);
+    name_ofs += strlen(s->id) + 1;
+  }
+  hdr.num_symbols = sym->num_symbols;
+
+  for (i = 0; i < sym->num_fixups; ++i) {
+    const fixup_t *fix = &sym->fixups[i];
+    const sym_def_t *s = &sym->symbols[fix->symbol];
+
+    if (!(s->flags & (SYM_UNDEFINED | SYM_RELOC))) {
+      if (asm_patch(cpu->mem, fix->pos, fix->mode, s->address) != 0)
+        goto out;
+      continue;
+    }
+
+    int sec = find_section(secs, hdr.num_sections, fix->pos);
+    if (sec == -1) {
+      fprintf(stderr, "error: operand at $%04X isn't in any section\n",
+              fix->pos);
+      goto out;
+    }
+
+    obj_reloc_t *r = &relocs[hdr.num_relocs++];
+    r->symbol = fix->symbol;
+    r->pos = fix->pos;
+    r->section = sec;
+    r->mode = fix->mode;
+  }
+
+  /* with the fixed references patched, the bytes are final */
+  for (i = 0; i < hdr.num_sections; ++i) {
+    for (j = 0; j < secs[i].size; ++j)
+      data[secs[i].data + j] = cpu->mem[(uint16_t)(secs[i].base + j)];
+  }
+
+  memcpy(hdr.magic, OBJ_MAGIC, sizeof hdr.magic);
+  hdr.version = OBJ_VERSION;
+
+  char tmp[4096];
+  snprintf(tmp, sizeof tmp, "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    perror(tmp);
+    goto out;
+  }
+
+  size_t ok = 1;
+  ok &= fwrite(&hdr, sizeof hdr, 1, f) == 1;
+  ok &= fwrite(secs, sizeof *secs, hdr.num_sections, f) == hdr.num_sections;
+  ok &= fwrite(syms, sizeof *syms, hdr.num_symbols, f) == hdr.num_symbols;
+  ok &= fwrite(relocs, sizeof *relocs, hdr.num_relocs, f) == hdr.num_relocs;
+  ok &= fwrite(names, 1, hdr.names_size, f) == hdr.names_size;
+  ok &= fwrite(data, 1, hdr.data_size, f) == hdr.data_size;
+  ok &= fclose(f) == 0;
+
+  if (!ok || rename(tmp, path) != 0) {
+    perror(path);
+    unlink(tmp);
+    goto out;
+  }
+
+  ret = 0;
+
+out:
+  free(secs);
+  free(syms);
+  free(relocs);
+  free(names);
+  free(data);
+  return ret;
+}
+
+/* assembles one module from src into the object at path */
+int obj_assemble(const char *src, const char *path) {
+  cpu_state_t *cpu = calloc(1, sizeof *cpu);
+  symtab_t sym = {0};
+  int ret;
+
+  sym.flags = ASM_RELOCATABLE;
+  if (parse_asm_file(src, cpu, &sym) != 0) {
+    perror(src);
+    ret = -1;
+  }
+  else if (sym.num_errors) {
+    fprintf(stderr, "%s: %zu errors\n", src, sym.num_errors);
+    ret = -1;
+  }
+  else {
+    ret = obj_write(path, cpu, &sym);
+  }
+
+  sym_clear(&sym);
+  free(cpu);
+  return ret;
+}
+
+/* checks that every offset and index in the object stays inside it */
+static int obj_check(const obj_t *obj) {
+  const obj_header_t *hdr = obj->hdr;
+  size_t i;
+
+  if (hdr->names_size && obj->names[hdr->names_size - 1] != '\0')
+    return -1;
+
+  for (i = 0; i < hdr->num_sections; ++i) {
+    const obj_section_t *sec = &obj->sections[i];
+    if ((uint64_t)sec->data + sec->size > hdr->data_size ||
+        sec->size > 0x10000)
+      return -1;
+  }
+
+  for (i = 0; i < hdr->num_symbols; ++i) {
+    const obj_symbol_t *s = &obj->symbols[i];
+    if (s->name >= hdr->names_size ||
+        (s->section != OBJ_ABSOLUTE && s->section >= hdr->num_sections))
+      return -1;
+  }
+
+  for (i = 0; i < hdr->num_relocs; ++i) {
+    const obj_reloc_t *r = &obj->relocs[i];
+    if (r->symbol >= hdr->num_symbols || r->section >= hdr->num_sections ||
+        r->mode >= ADR_MAX)
+      return -1;
+  }
+
+  return 0;
+}
+
+int obj_open(obj_t *obj, const char *path) {
+  memset(obj, 0, sizeof *obj);
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(obj_header_t)) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const obj_header_t *hdr = map;
+  obj->hdr = hdr;
+  obj->size = st.st_size;
+  obj->path = path;
+
+  uint64_t size = sizeof *hdr +
+    (uint64_t)hdr->num_sections * sizeof(obj_section_t) +
+    (uint64_t)hdr->num_symbols * sizeof(obj_symbol_t) +
+    (uint64_t)hdr->num_relocs * sizeof(obj_reloc_t) +
+    hdr->names_size + hdr->data_size;
+
+  if (memcmp(hdr->magic, OBJ_MAGIC, sizeof hdr->magic) != 0 ||
+      hdr->version != OBJ_VERSION || size > (uint64_t)st.st_size) {
+    obj_close(obj);
+    return -1;
+  }
+
+  const uint8_t *p = (const uint8_t *)map + sizeof *hdr;
+  obj->sections = (const obj_section_t *)p;
+  p += hdr->num_sections * sizeof(obj_section_t);
+  obj->symbols = (const obj_symbol_t *)p;
+  p += hdr->num_symbols * sizeof(obj_symbol_t);
+  obj->relocs = (const obj_reloc_t *)p;
+  p += hdr->num_relocs * sizeof(obj_reloc_t);
+  obj->names = (const char *)p;
+  obj->data = p + hdr->names_size;
+
+  if (obj_check(obj) != 0) {
+    obj_close(obj);
+    return -1;
+  }
+
+  return 0;
+}
+
+void obj_close(obj_t *obj) {
+  if (obj->hdr)
+    munmap((void *)obj->hdr, obj->size);
+  memset(obj, 0, sizeof *obj);
+}
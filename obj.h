@@ -0,0 +1,74 @@
+#ifndef P64_OBJ_H
+#define P64_OBJ_H
+
+/*
+ * Relocatable object files.
+ *
+ * An object is what assembling one module with ASM_RELOCATABLE leaves: its
+ * sections, every symbol it defines or uses, and a relocation for every
+ * operand that refers to a relocatable or undefined symbol. The file is a
+ * header, three tables of fixed size entries, the symbol names and the
+ * section bytes, all 4 byte aligned and in host byte order so a mapped
+ * file can be used in place.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "6502.h"
+#include "asm.h"
+
+#define OBJ_MAGIC     "P64O"
+#define OBJ_VERSION   1
+#define OBJ_ABSOLUTE  0xFFFF    /* section of a symbol with a fixed address */
+
+typedef struct obj_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_sections;
+  uint32_t num_symbols;
+  uint32_t num_relocs;
+  uint32_t names_size;      /* padded to 4 */
+  uint32_t data_size;
+} obj_header_t;
+
+typedef struct obj_section {
+  uint32_t data;            /* offset of the bytes in the section data */
+  uint32_t size;
+  uint16_t base;            /* where the module was assembled to */
+  uint16_t flags;           /* SECTION_RELOC */
+} obj_section_t;
+
+typedef struct obj_symbol {
+  uint32_t name;            /* offset into the names */
+  uint16_t address;
+  uint16_t section;         /* for SYM_RELOC, OBJ_ABSOLUTE otherwise */
+  uint8_t flags;            /* SYM_* */
+  uint8_t pad[3];
+} obj_symbol_t;
+
+typedef struct obj_reloc {
+  uint32_t symbol;
+  uint16_t pos;             /* of the operand, as assembled */
+  uint16_t section;
+  uint8_t mode;
+  uint8_t pad[3];
+} obj_reloc_t;
+
+/* a mapped object, everything points into the mapping */
+typedef struct obj {
+  const obj_header_t *hdr;
+  const obj_section_t *sections;
+  const obj_symbol_t *symbols;
+  const obj_reloc_t *relocs;
+  const char *names;
+  const uint8_t *data;
+  size_t size;
+  const char *path;         /* as given to obj_open */
+} obj_t;
+
+int obj_write(const char *path, struct cpu_state *, struct symtab *);
+int obj_assemble(const char *src, const char *path);
+int obj_open(obj_t *, const char *path);
+void obj_close(obj_t *);
+
+#endif /* !P64_OBJ_H */
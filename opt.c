@@ -0,0 +1,634 @@
+#include "opt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* what an instruction does to the state that's tracked */
+enum {
+  K_OTHER,   /* nothing that's tracked: nop, cld, sei, ... */
+  K_LOAD,    /* dst = operand */
+  K_STORE,   /* operand = src */
+  K_TRANS,   /* dst = src */
+  K_SET,     /* dst = something new, N/Z from it */
+  K_FLAGS,   /* N/Z from something else */
+  K_RMW,     /* inc/dec of the operand */
+  K_CLC,
+  K_SEC,
+  K_BRANCH,
+  K_JMP,
+  K_JSR,
+  K_RTS,
+  K_PUSH,
+  K_PULL     /* plp */
+};
+
+#define F_CARRY  0x01  /* leaves the carry unknown */
+#define F_STACK  0x02  /* uses the stack, which can also stop the machine */
+
+#define R_A 0
+#define R_X 1
+#define R_Y 2
+
+static const struct {
+  const char *name;
+  uint8_t kind;
+  int8_t src, dst;
+  uint8_t flags;
+} kinds[] = {
+  {"lda", K_LOAD,   -1, R_A, 0},       {"ldx", K_LOAD,   -1, R_X, 0},
+  {"ldy", K_LOAD,   -1, R_Y, 0},       {"sta", K_STORE, R_A,  -1, 0},
+  {"stx", K_STORE, R_X,  -1, 0},       {"sty", K_STORE, R_Y,  -1, 0},
+  {"tax", K_TRANS, R_A, R_X, 0},       {"tay", K_TRANS, R_A, R_Y, 0},
+  {"txa", K_TRANS, R_X, R_A, 0},       {"tya", K_TRANS, R_Y, R_A, 0},
+  {"inx", K_SET,    -1, R_X, 0},       {"dex", K_SET,    -1, R_X, 0},
+  {"iny", K_SET,    -1, R_Y, 0},       {"dey", K_SET,    -1, R_Y, 0},
+  {"and", K_SET,    -1, R_A, 0},       {"ora", K_SET,    -1, R_A, 0},
+  {"eor", K_SET,    -1, R_A, 0},       {"adc", K_SET,    -1, R_A, F_CARRY},
+  {"sbc", K_SET,    -1, R_A, F_CARRY}, {"pla", K_SET,    -1, R_A, F_STACK},
+  {"tsx", K_SET,    -1, R_X, 0},       {"txs", K_FLAGS,  -1,  -1, 0},
+  {"cmp", K_FLAGS,  -1,  -1, F_CARRY}, {"inc", K_RMW,    -1,  -1, 0},
+  {"dec", K_RMW,    -1,  -1, 0},       {"clc", K_CLC,    -1,  -1, 0},
+  {"sec", K_SEC,    -1,  -1, 0},       {"jmp", K_JMP,    -1,  -1, 0},
+  {"jsr", K_JSR,    -1,  -1, 0},       {"rts", K_RTS,    -1,  -1, F_STACK},
+  {"pha", K_PUSH,   -1,  -1, F_STACK}, {"php", K_PUSH,   -1,  -1, F_STACK},
+  {"plp", K_PULL,   -1,  -1, F_CARRY | F_STACK},
+};
+
+typedef struct node {
+  asm_instr_t *in;          /* as recorded */
+  uint16_t pos;             /* where it was assembled */
+  uint16_t to;              /* where it's moved to */
+  uint16_t val;             /* operand, the target for branches */
+  uint16_t target;          /* of a branch, before it was inverted */
+  uint8_t op, shrunk_from;
+  uint8_t len;              /* as assembled */
+  uint8_t kind;
+  uint8_t leader;           /* starts a basic block */
+  uint8_t seg_start;        /* starts a run of contiguous code */
+  uint8_t dead;
+  uint8_t relaxed;          /* was a branch over the jmp that follows */
+  uint8_t keep_jmp;         /* mustn't be inverted, it wouldn't reach */
+  const char *why;          /* for dead */
+} node_t;
+
+/* a value number for every register and the memory seen in a block, equal
+ * numbers are equal values. 0 is nothing known, immediates are 1-256 */
+typedef struct mem_val {
+  uint16_t adr;
+  uint32_t vn;
+} mem_val_t;
+
+typedef struct block_state {
+  uint32_t reg[3];
+  uint32_t nz;              /* the value N and Z were set from */
+  int carry;                /* -1 when unknown */
+  uint32_t next_vn;
+  mem_val_t *mem;
+  size_t num_mem;
+  mem_val_t *pending;       /* stores nothing has read yet, vn is the node */
+  size_t num_pending;
+} block_state_t;
+
+/* the entry in kinds, 0xFF for branches and what isn't tracked */
+static uint8_t classify(uint8_t op) {
+  const opc_descr_t *d = instr_descr(op);
+  size_t i;
+
+  for (i = 0; i < sizeof kinds / sizeof kinds[0]; ++i) {
+    if (strcmp(kinds[i].name, d->name) == 0)
+      return i;
+  }
+
+  return 0xFF;
+}
+
+static int kind_of(const node_t *n) {
+  return (instr_descr(n->op)->addr_m == ADR_REL ? K_BRANCH :
+          n->kind == 0xFF ? K_OTHER : kinds[n->kind].kind);
+}
+
+static uint16_t read_operand(const uint8_t *mem, uint16_t pos, uint8_t op) {
+  uint8_t mode = instr_descr(op)->addr_m;
+  if (mode == ADR_IMP)
+    return 0;
+  if (mode == ADR_REL)
+    return pos + 2 + (int8_t)mem[(uint16_t)(pos + 1)];
+  if (instr_len(op) == 3)
+    return mem[(uint16_t)(pos + 1)] << 8 | mem[(uint16_t)(pos + 2)];
+  return mem[(uint16_t)(pos + 1)];
+}
+
+/* the first node at or after pos */
+static size_t lower_bound(const node_t *nodes, size_t num, uint16_t pos) {
+  size_t lo = 0, hi = num;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (nodes[mid].pos < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* the node at pos, -1 if no instruction starts there */
+static long find_node(const node_t *nodes, size_t num, uint16_t pos) {
+  size_t i = lower_bound(nodes, num, pos);
+  return (i < num && nodes[i].pos == pos ? (long)i : -1);
+}
+
+static int by_pos(const void *a, const void *b) {
+  const node_t *na = a, *nb = b;
+  return (int)na->pos - (int)nb->pos;
+}
+
+/* one past the last byte of the segment node i is in, as assembled */
+static uint32_t seg_end(const node_t *nodes, size_t num, size_t i) {
+  while (i + 1 < num && !nodes[i + 1].seg_start)
+    i++;
+  return (uint32_t)nodes[i].pos + nodes[i].len;
+}
+
+/* whether control gets from node i to adr without any live instruction in
+ * between, so a jump there can go */
+static int falls_to(const node_t *nodes, size_t num, size_t i, uint16_t adr) {
+  size_t j;
+  for (j = i + 1; j < num && !nodes[j].seg_start; ++j) {
+    if (nodes[j].pos == adr)
+      return 1;
+    if (!nodes[j].dead)
+      return 0;
+  }
+
+  return seg_end(nodes, num, i) == adr;
+}
+
+/* where the code at adr is moved to, adr itself if it isn't code */
+static uint16_t moved(const node_t *nodes, size_t num, uint16_t adr) {
+  size_t i = lower_bound(nodes, num, adr);
+  if (i < num && nodes[i].pos == adr)
+    return nodes[i].to;
+
+  /* one past the end of a segment moves with it */
+  if (i > 0 && nodes[i - 1].pos + nodes[i - 1].len == adr &&
+      (i == num || nodes[i].seg_start))
+    return nodes[i - 1].to + (nodes[i - 1].dead ? 0 :
+                              instr_len(nodes[i - 1].op));
+
+  return adr;
+}
+
+static uint32_t mem_vn(block_state_t *s, uint16_t adr) {
+  size_t i;
+  for (i = 0; i < s->num_mem; ++i) {
+    if (s->mem[i].adr == adr)
+      return s->mem[i].vn;
+  }
+
+  s->mem[s->num_mem].adr = adr;
+  s->mem[s->num_mem].vn = s->next_vn++;
+  return s->mem[s->num_mem++].vn;
+}
+
+static void set_mem_vn(block_state_t *s, uint16_t adr, uint32_t vn) {
+  size_t i;
+  for (i = 0; i < s->num_mem; ++i) {
+    if (s->mem[i].adr == adr) {
+      s->mem[i].vn = vn;
+      return;
+    }
+  }
+
+  s->mem[s->num_mem].adr = adr;
+  s->mem[s->num_mem++].vn = vn;
+}
+
+static void forget_stack(block_state_t *s) {
+  size_t i, kept = 0;
+  for (i = 0; i < s->num_mem; ++i) {
+    if ((s->mem[i].adr >> 8) != 0x01)
+      s->mem[kept++] = s->mem[i];
+  }
+  s->num_mem = kept;
+}
+
+static void read_mem(block_state_t *s, uint16_t adr) {
+  size_t i, kept = 0;
+  for (i = 0; i < s->num_pending; ++i) {
+    if (s->pending[i].adr != adr)
+      s->pending[kept++] = s->pending[i];
+  }
+  s->num_pending = kept;
+}
+
+static void reset_block(block_state_t *s) {
+  memset(s->reg, 0, sizeof s->reg);
+  s->nz = 0;
+  s->carry = -1;
+  s->num_mem = 0;
+  s->num_pending = 0;
+}
+
+static void kill(node_t *n, const char *why) {
+  n->dead = 1;
+  n->why = why;
+}
+
+/*
+ * Goes through every basic block keeping a value number for each register,
+ * the memory it has seen, the carry and what N/Z were set from. Loads and
+ * transfers of what's already there, with the flags already set from it,
+ * go, as do clc/sec of a known carry, stores of what memory already holds
+ * and stores that are stored over before anything could read them.
+ */
+static void simplify_blocks(node_t *nodes, size_t num) {
+  block_state_t s = {{0}};
+  size_t i, j;
+
+  s.next_vn = 0x200;
+  s.mem = malloc((num + 1) * sizeof *s.mem);
+  s.pending = malloc((num + 1) * sizeof *s.pending);
+  reset_block(&s);
+
+  for (i = 0; i < num; ++i) {
+    node_t *n = &nodes[i];
+    uint8_t mode = instr_descr(n->op)->addr_m;
+    int direct = (mode == ADR_ZP || mode == ADR_ABS);
+    int indexed = !direct && mode != ADR_IMP && mode != ADR_IMM &&
+                  mode != ADR_REL;
+    int k = kind_of(n);
+    int src = (n->kind != 0xFF ? kinds[n->kind].src : -1);
+    int dst = (n->kind != 0xFF ? kinds[n->kind].dst : -1);
+    int flags = (n->kind != 0xFF ? kinds[n->kind].flags : 0);
+    uint32_t vn;
+
+    if (n->leader)
+      reset_block(&s);
+
+    if (k == K_LOAD) {
+      vn = (mode == ADR_IMM ? n->val + 1u :
+            direct ? mem_vn(&s, n->val) : s.next_vn++);
+      if (vn == s.reg[dst] && vn == s.nz) {
+        kill(n, "loads what's already there");
+        continue;
+      }
+      s.reg[dst] = s.nz = vn;
+    }
+    else if (k == K_TRANS) {
+      if (s.reg[src] && s.reg[src] == s.reg[dst] && s.reg[src] == s.nz) {
+        kill(n, "transfers what's already there");
+        continue;
+      }
+      s.reg[dst] = s.nz = s.reg[src];
+      if (!s.nz)
+        s.reg[src] = s.reg[dst] = s.nz = s.next_vn++;
+    }
+    else if (k == K_STORE && direct) {
+      if (s.reg[src] && mem_vn(&s, n->val) == s.reg[src]) {
+        kill(n, "stores what's already there");
+        continue;
+      }
+
+      for (j = 0; j < s.num_pending; ++j) {
+        if (s.pending[j].adr == n->val) {
+          kill(&nodes[s.pending[j].vn], "is stored over before it's read");
+          s.pending[j].vn = i;
+          break;
+        }
+      }
+      if (j == s.num_pending) {
+        s.pending[s.num_pending].adr = n->val;
+        s.pending[s.num_pending++].vn = i;
+      }
+
+      if (!s.reg[src])
+        s.reg[src] = s.next_vn++;
+      set_mem_vn(&s, n->val, s.reg[src]);
+      continue;
+    }
+    else if (k == K_STORE) {
+      /* could be anywhere, and (zp),y reads its pointer */
+      s.num_mem = 0;
+      if (mode == ADR_IZX || mode == ADR_IZY)
+        s.num_pending = 0;
+      continue;
+    }
+    else if (k == K_SET) {
+      s.reg[dst] = s.nz = s.next_vn++;
+    }
+    else if (k == K_FLAGS || k == K_PULL) {
+      s.nz = 0;
+    }
+    else if (k == K_RMW) {
+      if (direct) {
+        read_mem(&s, n->val);
+        set_mem_vn(&s, n->val, s.nz = s.next_vn++);
+      }
+      else {
+        s.num_mem = 0;
+        s.num_pending = 0;
+        s.nz = 0;
+      }
+      continue;
+    }
+    else if (k == K_CLC || k == K_SEC) {
+      int carry = (k == K_SEC);
+      if (s.carry == carry) {
+        kill(n, (carry ? "the carry is already set" :
+                 "the carry is already clear"));
+        continue;
+      }
+      s.carry = carry;
+    }
+    else if (k == K_PUSH) {
+      forget_stack(&s);
+    }
+    else if (k == K_BRANCH) {
+      /* the other way may read any of it */
+      s.num_pending = 0;
+    }
+    else if (k == K_JMP || k == K_JSR || k == K_RTS) {
+      reset_block(&s);
+      continue;
+    }
+
+    if (flags & F_CARRY)
+      s.carry = -1;
+    if (flags & F_STACK)
+      s.num_pending = 0;
+
+    /* what's left reads its operand */
+    if (direct && k != K_JMP)
+      read_mem(&s, n->val);
+    else if (indexed)
+      s.num_pending = 0;
+  }
+
+  free(s.mem);
+  free(s.pending);
+}
+
+/*
+ * Jumps and branches to where the code would go anyway go, and a branch
+ * over a jmp becomes the inverted branch to where the jmp goes. Runs until
+ * nothing changes, as each change can bring another one's target closer.
+ */
+static void relax_jumps(node_t *nodes, size_t num) {
+  int changed = 1;
+  size_t i, j;
+
+  while (changed) {
+    changed = 0;
+    for (i = 0; i < num; ++i) {
+      node_t *n = &nodes[i];
+      int k = kind_of(n);
+      uint8_t mode = instr_descr(n->op)->addr_m;
+
+      if (n->dead || !(k == K_BRANCH || (k == K_JMP && mode == ADR_ABS)))
+        continue;
+
+      if (falls_to(nodes, num, i, n->val)) {
+        kill(n, (k == K_JMP ? "jumps to the next instruction" :
+                 "branches to the next instruction"));
+        changed = 1;
+        continue;
+      }
+
+      if (k != K_BRANCH || n->keep_jmp)
+        continue;
+
+      for (j = i + 1; j < num && !nodes[j].seg_start && nodes[j].dead; ++j)
+        ;
+      if (j == num || nodes[j].seg_start || nodes[j].leader ||
+          kind_of(&nodes[j]) != K_JMP ||
+          instr_descr(nodes[j].op)->addr_m != ADR_ABS ||
+          !falls_to(nodes, num, j, n->val))
+        continue;
+
+      /* the branch pairs are $20 apart: bpl/bmi, bvc/bvs, bcc/bcs, bne/beq */
+      n->op ^= 0x20;
+      n->val = nodes[j].val;
+      n->relaxed = 1;
+      kill(&nodes[j], NULL);
+      changed = 1;
+    }
+  }
+}
+
+/* gives every node its new address, returns a branch that doesn't reach
+ * any more or -1 */
+static long lay_out(node_t *nodes, size_t num) {
+  uint16_t at = 0;
+  size_t i;
+
+  for (i = 0; i < num; ++i) {
+    if (nodes[i].seg_start)
+      at = nodes[i].pos;
+    nodes[i].to = at;
+    if (!nodes[i].dead)
+      at += instr_len(nodes[i].op);
+  }
+
+  for (i = 0; i < num; ++i) {
+    const node_t *n = &nodes[i];
+    if (n->dead || instr_descr(n->op)->addr_m != ADR_REL)
+      continue;
+
+    int rel = (int)moved(nodes, num, n->val) - (uint16_t)(n->to + 2);
+    if (rel < -128 || rel > 127)
+      return i;
+  }
+
+  return -1;
+}
+
+static const char *plural(int n) {return (n != 1 ? "s" : "");}
+
+static void log_change(const node_t *n, const char *what, int bytes,
+                       int cycles, int *total_bytes, int *total_cycles) {
+  printf("opt: $%04X %s: %s, saves %d byte%s and %d cycle%s\n", n->pos,
+         instr_descr(n->in->op)->name, what, bytes, plural(bytes), cycles,
+         plural(cycles));
+  *total_bytes += bytes;
+  *total_cycles += cycles;
+}
+
+int asm_optimize(struct cpu_state *cpu, struct symtab *sym) {
+  size_t num = sym->num_instrs;
+  size_t i;
+
+  if (!num)
+    return 0;
+
+  node_t *nodes = calloc(num, sizeof *nodes);
+  for (i = 0; i < num; ++i) {
+    node_t *n = &nodes[i];
+    n->in = &sym->instrs[i];
+    n->pos = n->in->pos;
+    n->op = n->in->op;
+    n->len = instr_len(n->op);
+    n->val = n->target = read_operand(cpu->mem, n->pos, n->op);
+    n->kind = classify(n->op);
+  }
+
+  qsort(nodes, num, sizeof *nodes, by_pos);
+
+  for (i = 0; i < num; ++i) {
+    if (i > 0 && nodes[i].pos < nodes[i - 1].pos + nodes[i - 1].len) {
+      printf("opt: code at $%04X was assembled over, leaving it as it is\n",
+             nodes[i].pos);
+      free(nodes);
+      return -1;
+    }
+
+    nodes[i].seg_start = (i == 0 ||
+                          nodes[i].pos != nodes[i - 1].pos + nodes[i - 1].len);
+    nodes[i].leader = nodes[i].seg_start;
+  }
+
+  /* blocks start where anything could jump in */
+  long at = find_node(nodes, num, cpu->pc);
+  if (at != -1)
+    nodes[at].leader = 1;
+
+  for (i = 0; i < sym->num_symbols; ++i) {
+    if (sym->symbols[i].flags & SYM_UNDEFINED)
+      continue;
+    at = find_node(nodes, num, sym->symbols[i].address);
+    if (at != -1)
+      nodes[at].leader = 1;
+  }
+
+  for (i = 0; i < num; ++i) {
+    int k = kind_of(&nodes[i]);
+    if (k != K_BRANCH && k != K_JMP && k != K_JSR)
+      continue;
+    at = find_node(nodes, num, nodes[i].val);
+    if (at != -1)
+      nodes[at].leader = 1;
+  }
+
+  /* zero page forms, only where they behave the same. abs,x and abs,y
+   * don't wrap within the zero page like zp,x and zp,y do */
+  for (i = 0; i < num; ++i) {
+    node_t *n = &nodes[i];
+    const opc_descr_t *d = instr_descr(n->op);
+    if (d->addr_m != ADR_ABS || n->val > 0xFF)
+      continue;
+
+    const instr_set_t *set = instr_opcodes(d->name, strlen(d->name));
+    if (set && (set->modes & (1 << ADR_ZP))) {
+      n->shrunk_from = n->op;
+      n->op = set->opcode[ADR_ZP];
+    }
+  }
+
+  simplify_blocks(nodes, num);
+
+  uint8_t *dead = malloc(num);
+  for (i = 0; i < num; ++i)
+    dead[i] = nodes[i].dead;
+
+  /* an inverted branch that doesn't reach stays as it was, and everything
+   * after the blocks were simplified is redone without it */
+  long bad;
+  do {
+    relax_jumps(nodes, num);
+    bad = lay_out(nodes, num);
+    if (bad != -1 && nodes[bad].relaxed) {
+      for (i = 0; i < num; ++i) {
+        node_t *n = &nodes[i];
+        if (n->relaxed) {
+          n->op ^= 0x20;
+          n->relaxed = 0;
+        }
+        n->val = n->target;
+        n->dead = dead[i];
+        n->why = (n->dead ? n->why : NULL);
+      }
+      nodes[bad].keep_jmp = 1;
+    }
+    else if (bad != -1) {
+      printf("opt: branch at $%04X can't reach $%04X once moved, leaving "
+             "the code as it is\n", nodes[bad].pos, nodes[bad].val);
+      free(dead);
+      free(nodes);
+      return -1;
+    }
+  } while (bad != -1);
+
+  free(dead);
+
+  /* labels and the pc move with the code */
+  for (i = 0; i < sym->num_symbols; ++i) {
+    if (!(sym->symbols[i].flags & SYM_UNDEFINED))
+      sym->symbols[i].address = moved(nodes, num, sym->symbols[i].address);
+  }
+  free(sym->by_address);
+  sym->by_address = NULL;
+  cpu->pc = moved(nodes, num, cpu->pc);
+
+  for (i = 0; i < num; ++i) {
+    if (nodes[i].seg_start)
+      memset(&cpu->mem[nodes[i].pos], 0,
+             seg_end(nodes, num, i) - nodes[i].pos);
+  }
+
+  asm_instr_t *instrs = malloc(num * sizeof *instrs);
+  int bytes = 0, cycles = 0, changes = 0;
+  size_t kept = 0;
+  for (i = 0; i < num; ++i) {
+    node_t *n = &nodes[i];
+    uint8_t mode = instr_descr(n->op)->addr_m;
+
+    if (n->shrunk_from && !n->dead) {
+      log_change(n, "zero page operand", 1,
+                 instr_cycles(n->shrunk_from) - instr_cycles(n->op),
+                 &bytes, &cycles);
+      changes++;
+    }
+
+    if (n->dead) {
+      if (n->why) {
+        log_change(n, n->why, n->len, instr_cycles(n->in->op), &bytes,
+                   &cycles);
+        changes++;
+      }
+      continue;
+    }
+
+    if (n->relaxed) {
+      log_change(n, "inverted over the jmp after it", 3, instr_cycles(0x4C),
+                 &bytes, &cycles);
+      changes++;
+    }
+
+    uint16_t val = n->val;
+    if (mode == ADR_REL)
+      val = moved(nodes, num, n->val);
+    else if (n->in->flags & ASM_INSTR_SYM)
+      val = sym->symbols[n->in->symbol].address;
+
+    cpu->mem[n->to] = n->op;
+    if (mode != ADR_IMP)
+      asm_patch(cpu->mem, n->to + 1, mode, val);
+
+    /* what's recorded follows, for the next time */
+    instrs[kept] = *n->in;
+    instrs[kept].pos = n->to;
+    instrs[kept++].op = n->op;
+  }
+
+  free(sym->instrs);
+  sym->instrs = instrs;
+  sym->num_instrs = kept;
+  sym->max_instrs = num;
+
+  printf("opt: %d change%s, saves %d byte%s and %d cycle%s\n", changes,
+         plural(changes), bytes, plural(bytes), cycles, plural(cycles));
+
+  free(nodes);
+  return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef P64_OPT_H
+#define P64_OPT_H
+
+/*
+ * A peephole pass over assembled code.
+ *
+ * Works on the instructions the assembler recorded with ASM_OPTIMIZE, after
+ * they've been linked. Absolute operands under $100 get their zero page
+ * opcode, loads of a value a register already holds and clc/sec of a carry
+ * that's already known go away, as do stores that are overwritten before
+ * anything in the basic block could read them, and a branch over a jmp
+ * becomes the inverted branch. The code is then moved together and labels
+ * and branches follow it. Memory is assumed to be plain ram, and numeric
+ * addresses into the code aren't moved along with it - use labels.
+ *
+ * Every change is logged to stdout with what it saves.
+ */
+
+#include "6502.h"
+#include "asm.h"
+
+/* returns -1 and leaves the code alone if it can't be laid out again */
+int asm_optimize(struct cpu_state *, struct symtab *);
+
+#endif /* !P64_OPT_H */
@@ -0,0 +1,178 @@
+/*
+ * Assembles modules into objects and links them into a .prg.
+ *
+ * usage: p64as [-j jobs] [-b base] [-o out.prg] [-c] [-B] source ...
+ *
+ * Every source is assembled into an object next to it, with the extension
+ * replaced by .o, on a pool of -j threads (default: one per cpu). Objects
+ * newer than their source are reused unless -B is given. -c stops after
+ * assembling, otherwise the objects are linked with the relocatable code
+ * placed from -b (default $1000) and written to -o (default a.prg).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "obj.h"
+#include "link.h"
+#include "prg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_JOBS 64
+
+typedef struct module {
+  const char *src;
+  char *obj;
+  int stale;
+  int status;
+} module_t;
+
+static module_t *modules;
+static size_t num_modules;
+static size_t next_module;
+
+static long parse_num(const char *s) {
+  if (s[0] == '$')
+    return strtol(s + 1, NULL, 16);
+  return strtol(s, NULL, 0);
+}
+
+static char *obj_path(const char *src) {
+  const char *slash = strrchr(src, '/');
+  const char *dot = strrchr(src, '.');
+  size_t len = (dot && (!slash || dot > slash) ? (size_t)(dot - src)
+                                               : strlen(src));
+  char *path = malloc(len + 3);
+  memcpy(path, src, len);
+  strcpy(path + len, ".o");
+  return path;
+}
+
+/* the object is out of date if it's missing or not newer than the source */
+static int is_stale(const module_t *m) {
+  struct stat src, obj;
+  if (stat(m->src, &src) != 0 || stat(m->obj, &obj) != 0)
+    return 1;
+
+  if (obj.st_mtim.tv_sec != src.st_mtim.tv_sec)
+    return obj.st_mtim.tv_sec < src.st_mtim.tv_sec;
+  return obj.st_mtim.tv_nsec <= src.st_mtim.tv_nsec;
+}
+
+static void *worker(void *arg) {
+  size_t i;
+  (void)arg;
+
+  while ((i = __atomic_fetch_add(&next_module, 1, __ATOMIC_RELAXED)) <
+         num_modules) {
+    module_t *m = &modules[i];
+    if (m->stale)
+      m->status = obj_assemble(m->src, m->obj);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  const char *out = "a.prg";
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  long base = 0x1000;
+  int only_assemble = 0, rebuild = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-c") == 0)
+      only_assemble = 1;
+    else if (strcmp(argv[i], "-B") == 0)
+      rebuild = 1;
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      jobs = parse_num(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      base = parse_num(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      out = argv[++i];
+    else
+      break;
+  }
+
+  if (i >= argc) {
+    fprintf(stderr, "usage: %s [-j jobs] [-b base] [-o out.prg] [-c] [-B] "
+            "source ...\n", argv[0]);
+    return 1;
+  }
+
+  num_modules = argc - i;
+  modules = calloc(num_modules, sizeof *modules);
+
+  size_t m, num_stale = 0;
+  for (m = 0; m < num_modules; ++m) {
+    modules[m].src = argv[i + m];
+    modules[m].obj = obj_path(argv[i + m]);
+    modules[m].stale = rebuild || is_stale(&modules[m]);
+    num_stale += modules[m].stale;
+  }
+
+  if (jobs < 1)
+    jobs = 1;
+  if (jobs > MAX_JOBS)
+    jobs = MAX_JOBS;
+  if ((size_t)jobs > num_stale)
+    jobs = (num_stale ? num_stale : 1);
+
+  pthread_t threads[MAX_JOBS];
+  long t;
+  for (t = 1; t < jobs; ++t)
+    pthread_create(&threads[t], NULL, worker, NULL);
+  worker(NULL);
+  for (t = 1; t < jobs; ++t)
+    pthread_join(threads[t], NULL);
+
+  int failed = 0;
+  for (m = 0; m < num_modules; ++m)
+    failed |= modules[m].status;
+
+  printf("assembled %zu of %zu modules on %ld threads\n", num_stale,
+         num_modules, jobs);
+
+  if (failed || only_assemble)
+    return (failed ? 1 : 0);
+
+  obj_t *objs = calloc(num_modules, sizeof *objs);
+  for (m = 0; m < num_modules; ++m) {
+    if (obj_open(&objs[m], modules[m].obj) != 0) {
+      fprintf(stderr, "error: '%s' isn't a valid object\n", modules[m].obj);
+      return 1;
+    }
+  }
+
+  static cpu_state_t image;
+  uint16_t start;
+  uint32_t size;
+  if (link_objects(objs, num_modules, base, &image, &start, &size) != 0)
+    return 1;
+
+  if (!size) {
+    fprintf(stderr, "error: there is no code to write\n");
+    return 1;
+  }
+
+  if (save_prg(&image, out, start, size) != 0) {
+    perror(out);
+    return 1;
+  }
+
+  printf("wrote %s, $%04X-$%04X (%u bytes)\n", out, start,
+         (unsigned)(start + size - 1), (unsigned)size);
+
+  for (m = 0; m < num_modules; ++m) {
+    obj_close(&objs[m]);
+    free(modules[m].obj);
+  }
+  free(objs);
+  free(modules);
+  return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * Coverage guided fuzzer for 6502 routines, see fuzz.h.
+ *
+ * usage: p64fuzz [-r runs] [-t seconds] [-b budget] [-o dir]
+ *                image.prg entry input_adr input_max [seed ...]
+ *
+ * Addresses take $hex, 0xhex or decimal. Inputs that hit an illegal opcode
+ * or wrap the stack are written to dir/crash-<reason>-<pc>.
+ *
+ * Built with -DP64_LIBFUZZER this instead provides the libFuzzer entry
+ * points, configured through P64_FUZZ_IMAGE, P64_FUZZ_ENTRY,
+ * P64_FUZZ_INPUT, P64_FUZZ_MAX and P64_FUZZ_BUDGET.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "fuzz.h"
+#include "prg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_BUDGET 100000
+
+static fuzz_target_t target;
+static cpu_state_t cpu;
+
+static long parse_num(const char *s) {
+  if (s[0] == '$')
+    return strtol(s + 1, NULL, 16);
+  return strtol(s, NULL, 0);
+}
+
+static int setup_target(const char *image, long entry, long input_adr,
+                        long input_max, long budget) {
+  memset(&target, 0, sizeof target);
+  target.snapshot.ps = 0x20;
+  target.snapshot.sp = 0xFF;
+
+  if (load_prg(&target.snapshot, image) != 0) {
+    fprintf(stderr, "error: can't load '%s'\n", image);
+    return -1;
+  }
+
+  target.snapshot.pc = entry;
+  target.input_adr = input_adr;
+  target.input_max = input_max;
+  target.budget = budget;
+  return 0;
+}
+
+#ifdef P64_LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  const char *image = getenv("P64_FUZZ_IMAGE");
+  const char *entry = getenv("P64_FUZZ_ENTRY");
+  const char *input = getenv("P64_FUZZ_INPUT");
+  const char *max = getenv("P64_FUZZ_MAX");
+  const char *budget = getenv("P64_FUZZ_BUDGET");
+
+  if (!image || !entry || !input || !max) {
+    fprintf(stderr, "error: P64_FUZZ_IMAGE, P64_FUZZ_ENTRY, P64_FUZZ_INPUT "
+            "and P64_FUZZ_MAX must be set\n");
+    exit(1);
+  }
+
+  if (setup_target(image, parse_num(entry), parse_num(input), parse_num(max),
+                   budget ? parse_num(budget) : DEFAULT_BUDGET) != 0)
+    exit(1);
+
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  int reason = fuzz_run(&target, &cpu, data, size);
+  if (fuzz_is_crash(reason)) {
+    fprintf(stderr, "crash: stop reason %d at pc=$%04X\n", reason, cpu.pc);
+    abort();
+  }
+
+  return 0;
+}
+
+#else
+
+typedef struct input {
+  uint8_t *data;
+  size_t len;
+} input_t;
+
+static input_t *corpus;
+static size_t corpus_len, corpus_cap;
+static uint8_t virgin[CPU_COV_SIZE];
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void corpus_add(const uint8_t *data, size_t len) {
+  if (corpus_len == corpus_cap) {
+    corpus_cap = (corpus_cap ? corpus_cap * 2 : 64);
+    corpus = realloc(corpus, corpus_cap * sizeof *corpus);
+  }
+
+  input_t *in = &corpus[corpus_len++];
+  in->data = malloc(len ? len : 1);
+  in->len = len;
+  memcpy(in->data, data, len);
+}
+
+/* a few stacked havoc style mutations, buf holds at least max bytes */
+static size_t mutate(uint8_t *buf, size_t len, size_t max) {
+  static const uint8_t interesting[] = {0, 1, 0x7F, 0x80, 0xFF, ' ', '\n', '0'};
+  int n = 1 + rng() % 4;
+
+  while (n--) {
+    size_t pos = (len ? rng() % len : 0);
+
+    switch (rng() % 7) {
+    case 0:
+      if (len) buf[pos] ^= 1 << (rng() % 8);
+      break;
+    case 1:
+      if (len) buf[pos] = rng();
+      break;
+    case 2:
+      if (len) buf[pos] = interesting[rng() % sizeof interesting];
+      break;
+    case 3:
+      if (len) buf[pos] += (uint8_t)(rng() % 33) - 16;
+      break;
+    case 4: /* insert */
+      if (len < max) {
+        memmove(buf + pos + 1, buf + pos, len - pos);
+        buf[pos] = rng();
+        len++;
+      }
+      break;
+    case 5: /* delete */
+      if (len) {
+        memmove(buf + pos, buf + pos + 1, len - pos - 1);
+        len--;
+      }
+      break;
+    case 6: /* splice in a chunk of some other input */
+      if (corpus_len) {
+        const input_t *other = &corpus[rng() % corpus_len];
+        if (other->len) {
+          size_t from = rng() % other->len;
+          size_t chunk = 1 + rng() % (other->len - from);
+          if (pos + chunk > max)
+            chunk = max - pos;
+          memcpy(buf + pos, other->data + from, chunk);
+          if (pos + chunk > len)
+            len = pos + chunk;
+        }
+      }
+      break;
+    }
+  }
+
+  return len;
+}
+
+static void save_crash(const char *dir, int reason, const uint8_t *data,
+                       size_t len) {
+  /* one file per stop reason and pc, that's close enough to unique */
+  static uint8_t seen[4][0x10000 / 8];
+  uint16_t pc = cpu.pc;
+
+  if (seen[reason & 3][pc >> 3] & (1 << (pc & 7)))
+    return;
+  seen[reason & 3][pc >> 3] |= 1 << (pc & 7);
+
+  char path[512];
+  snprintf(path, sizeof path, "%s/crash-%d-%04X", dir, reason, pc);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return;
+  }
+
+  fwrite(data, 1, len, f);
+  fclose(f);
+  printf("crash: stop reason %d at pc=$%04X, saved to %s\n", reason, pc, path);
+}
+
+static int load_seed(const char *path, uint8_t *buf, size_t max) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  size_t len = fread(buf, 1, max, f);
+  fclose(f);
+  corpus_add(buf, len);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint64_t max_runs = 0;
+  double max_time = 0;
+  long budget = DEFAULT_BUDGET;
+  const char *out_dir = ".";
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+    if (i + 1 >= argc)
+      break;
+    switch (argv[i][1]) {
+    case 'r': max_runs = strtoull(argv[i + 1], NULL, 0); break;
+    case 't': max_time = atof(argv[i + 1]); break;
+    case 'b': budget = parse_num(argv[i + 1]); break;
+    case 'o': out_dir = argv[i + 1]; break;
+    default:  i = argc; break;
+    }
+  }
+
+  if (argc - i < 4) {
+    fprintf(stderr, "usage: %s [-r runs] [-t seconds] [-b budget] [-o dir] "
+            "image.prg entry input_adr input_max [seed ...]\n", argv[0]);
+    return 1;
+  }
+
+  if (setup_target(argv[i], parse_num(argv[i + 1]), parse_num(argv[i + 2]),
+                   parse_num(argv[i + 3]), budget) != 0)
+    return 1;
+
+  size_t max = target.input_max;
+  uint8_t *buf = malloc(max + 1);
+  memset(virgin, 0xFF, sizeof virgin);
+
+  for (i += 4; i < argc; ++i)
+    load_seed(argv[i], buf, max);
+  if (!corpus_len)
+    corpus_add(buf, 0);
+
+  /* the seeds define the starting coverage */
+  size_t c;
+  for (c = 0; c < corpus_len; ++c) {
+    fuzz_run(&target, &cpu, corpus[c].data, corpus[c].len);
+    fuzz_new_coverage(virgin);
+  }
+
+  uint64_t runs = 0, hangs = 0, crashes = 0;
+  double start = now_s(), last_report = start;
+
+  while ((!max_runs || runs < max_runs) &&
+         (max_time <= 0 || now_s() - start < max_time)) {
+    const input_t *parent = &corpus[rng() % corpus_len];
+    memcpy(buf, parent->data, parent->len);
+    size_t len = mutate(buf, parent->len, max);
+
+    int reason = fuzz_run(&target, &cpu, buf, len);
+    runs++;
+
+    if (reason == STOP_BUDGET)
+      hangs++;
+
+    if (fuzz_is_crash(reason)) {
+      crashes++;
+      save_crash(out_dir, reason, buf, len);
+    }
+    else if (fuzz_new_coverage(virgin)) {
+      corpus_add(buf, len);
+    }
+
+    if ((runs & 0x3FF) == 0) {
+      double t = now_s();
+      if (t - last_report >= 1.0) {
+        printf("#%llu  %.0f exec/s  corpus %zu  edges %zu  crashes %llu  "
+               "hangs %llu\n",
+               (unsigned long long)runs, runs / (t - start), corpus_len,
+               fuzz_count_edges(virgin),
+               (unsigned long long)crashes, (unsigned long long)hangs);
+        last_report = t;
+      }
+    }
+  }
+
+  double t = now_s() - start;
+  printf("done: %llu runs in %.1fs (%.0f exec/s), corpus %zu, edges %zu, "
+         "crashes %llu, hangs %llu\n",
+         (unsigned long long)runs, t, t > 0 ? runs / t : 0.0, corpus_len,
+         fuzz_count_edges(virgin),
+         (unsigned long long)crashes, (unsigned long long)hangs);
+
+  return (crashes ? 2 : 0);
+}
+
+#endif /* P64_LIBFUZZER */
@@ -0,0 +1,126 @@
+/*
+ * Shows the live counters of every running emulator that was started with
+ * stats enabled. Only reads the shared memory segments, never stops them.
+ *
+ * usage: p64stat [-1] [interval ms]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static const char *stop_names[STATS_MAX_STOPS] = {
+  [STOP_BRK]     = "brk",
+  [STOP_BUDGET]  = "budget",
+  [STOP_ILLEGAL] = "illegal",
+  [STOP_STACK]   = "stack"
+};
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void show_segment(const char *name) {
+  char path[256];
+  snprintf(path, sizeof path, "/%s", name);
+
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd == -1)
+    return;
+
+  stats_t *s = mmap(NULL, sizeof(stats_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED)
+    return;
+
+  if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+      s->version != STATS_VERSION || s->size != sizeof(stats_t)) {
+    munmap(s, sizeof(stats_t));
+    return;
+  }
+
+  int alive = (kill(s->pid, 0) == 0 || errno != ESRCH);
+  uint64_t instrs = LOAD(s->instructions);
+  uint64_t cycles = LOAD(s->cycles);
+  double idle = (mono_ns() - LOAD(s->update_ns)) / 1e9;
+
+  printf("%7u %-5s %14llu %14llu %9.3f %6.2f %5llu %7.1fs ",
+         s->pid, alive ? "run" : "dead",
+         (unsigned long long)instrs,
+         (unsigned long long)cycles,
+         LOAD(s->ips) / 1e6,
+         instrs ? (double)cycles / instrs : 0.0,
+         (unsigned long long)LOAD(s->pages_in_use),
+         idle);
+
+  int i;
+  for (i = 0; i < STATS_MAX_STOPS; ++i) {
+    uint64_t n = LOAD(s->stops[i]);
+    if (n)
+      printf(" %s=%llu", stop_names[i] ? stop_names[i] : "?",
+             (unsigned long long)n);
+  }
+  printf("\n");
+
+  munmap(s, sizeof(stats_t));
+}
+
+static void show_all(void) {
+  const char *prefix = STATS_SHM_PREFIX + 1;
+  DIR *dir = opendir("/dev/shm");
+  if (!dir) {
+    perror("/dev/shm");
+    exit(1);
+  }
+
+  printf("    pid state   instructions         cycles      mips    cpi pages    idle  stops\n");
+
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (strncmp(ent->d_name, prefix, strlen(prefix)) == 0)
+      show_segment(ent->d_name);
+  }
+
+  closedir(dir);
+}
+
+int main(int argc, char **argv) {
+  int once = 0;
+  long interval_ms = 1000;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-1") == 0)
+      once = 1;
+    else
+      interval_ms = atol(argv[i]);
+  }
+
+  while (1) {
+    if (!once)
+      printf("\033[H\033[J");
+    show_all();
+    if (once)
+      break;
+
+    fflush(stdout);
+    struct timespec ts = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+  }
+
+  return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Regression checks for bugs that were found in review, one function per
+ * case. Guest code is given as bytes; remember that operands and pointers
+ * are stored hi byte first.
+ *
+ * usage: p64test
+ * prints each case and exits with 1 if any of them failed
+ */
+
+#include "6502.h"
+#include "memo.h"
+#include "cfg.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAIN 0x0200
+#define SUB  0x1100
+
+static cpu_state_t cpu;
+
+static void reset(const uint8_t *main, size_t main_len, const uint8_t *sub,
+                  size_t sub_len) {
+  memset(&cpu, 0, sizeof cpu);
+  cpu.ps = 0x20;
+  cpu.sp = 0xFF;
+  cpu.pc = MAIN;
+  memcpy(&cpu.mem[MAIN], main, main_len);
+  memcpy(&cpu.mem[SUB], sub, sub_len);
+}
+
+/* a memoized call through (zp),y sees the pointer change */
+static int memo_pointer_swap(void) {
+  static const uint8_t main[] = {0x20, SUB >> 8, SUB & 0xFF, 0x00};
+  static const uint8_t sub[] = {
+    0xA0, 0x00,        /* ldy #0 */
+    0xB1, 0x10,        /* lda ($10),y */
+    0x60               /* rts */
+  };
+  memo_config_t cfg = {.io_lo = 0xD000, .io_hi = 0xDFFF};
+  static cpu_state_t base;
+  int i, ok = 1;
+
+  reset(main, sizeof main, sub, sizeof sub);
+  cpu.mem[0x1000] = 0xAA;
+  cpu.mem[0x2000] = 0xBB;
+  base = cpu;
+
+  memo_enable(&cfg);
+  for (i = 0; i < 20; ++i) {
+    cpu = base;
+    cpu.mem[0x10] = 0x10;
+    cpu.mem[0x11] = 0x00;
+    run_machine_for(&cpu, 0, NULL);
+    ok &= (cpu.a == 0xAA);
+  }
+
+  cpu = base;
+  cpu.mem[0x10] = 0x20;
+  cpu.mem[0x11] = 0x00;
+  run_machine_for(&cpu, 0, NULL);
+  ok &= (cpu.a == 0xBB);
+
+  memo_disable();
+  return ok;
+}
+
+/* a traced call doesn't run past the budget */
+static int memo_budget(void) {
+  static const uint8_t main[] = {
+    0x20, SUB >> 8, SUB & 0xFF,          /* jsr sub */
+    0x4C, (MAIN + 3) >> 8, (MAIN + 3) & 0xFF  /* jmp * */
+  };
+  static const uint8_t sub[] = {
+    0xA0, 0x03,        /* ldy #3 */
+    0xA2, 0x00,        /* ldx #0 */
+    0xCA,              /* dex */
+    0xD0, 0xFD,        /* bne -3 */
+    0x88,              /* dey */
+    0xD0, 0xF8,        /* bne -8 */
+    0x60               /* rts */
+  };
+  memo_config_t cfg = {.io_lo = 0xD000, .io_hi = 0xDFFF};
+  uint64_t executed;
+
+  reset(main, sizeof main, sub, sizeof sub);
+  memo_enable(&cfg);
+  int reason = run_machine_for(&cpu, 100, &executed);
+  memo_disable();
+
+  return (reason == STOP_BUDGET && executed == 100);
+}
+
+/* the vectors are read hi byte first, like jmp (ind) */
+static int cfg_vectors(void) {
+  static uint8_t mem[MEM_MAX + 1];
+  const cfg_t *cfg;
+
+  memset(mem, 0, sizeof mem);
+  mem[0xFF10] = 0x60;  /* rts */
+  mem[0xFFFC] = 0xFF;
+  mem[0xFFFD] = 0x10;
+
+  cfg = cfg_analyze(mem, 0xFF00, 0x100, NULL, 0);
+  int ok = (cfg->map[0xFF10] & CFG_SUB) != 0;
+  cfg_cache_clear();
+  return ok;
+}
+
+/* an image that keeps being asked for stays cached while others go */
+static int cfg_cache_lru(void) {
+  static uint8_t mem[MEM_MAX + 1];
+  const cfg_t *first, *again;
+  int i, ok = 1;
+
+  memset(mem, 0, sizeof mem);
+  mem[MAIN] = 0x60;
+  first = cfg_analyze(mem, MAIN, 16, NULL, 0);
+
+  for (i = 0; i < 3 * CFG_CACHE_ENTRIES; ++i) {
+    mem[MAIN + 1] = i + 1;
+    cfg_analyze(mem, MAIN, 16, NULL, 0);
+
+    if (i % (CFG_CACHE_ENTRIES - 1) == 0) {
+      mem[MAIN + 1] = 0;
+      again = cfg_analyze(mem, MAIN, 16, NULL, 0);
+      ok &= (again == first);
+    }
+  }
+
+  cfg_cache_clear();
+  return ok;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} cases[] = {
+  {"memo_pointer_swap", memo_pointer_swap},
+  {"memo_budget",       memo_budget},
+  {"cfg_vectors",       cfg_vectors},
+  {"cfg_cache_lru",     cfg_cache_lru}
+};
+
+int main(void) {
+  size_t i;
+  int failed = 0;
+
+  for (i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+    int ok = cases[i].run();
+    printf("%-20s %s\n", cases[i].name, ok ? "ok" : "FAILED");
+    failed |= !ok;
+  }
+
+  return failed;
+}
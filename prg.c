@@ -1,32 +1,368 @@
+#define _POSIX_C_SOURCE 200809L
 #include "prg.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER  12         /* magic, version, a x y ps sp, pc */
+#define READ_CHUNK       0x10000
+#define CACHE_BUCKETS    256
+
+static const uint8_t snapshot_magic[4] = {'P', '6', '4', 0x1A};
+
+/* a parsed file, and what it looked like on disk */
+typedef struct cached {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint8_t *data;              /* the file, the segments point into it */
+    prg_image_t image;
+    struct cached *next;
+} cached_t;
+
+static cached_t *buckets[CACHE_BUCKETS];
+
+static uint16_t word(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static int fail(int err) {
+    errno = err;
+    return -1;
+}
+
+/* the segments of a PRG_SEGMENTS file go into segs unless it's NULL.
+ * returns how many there are, or -1 */
+static long find_segments(const uint8_t *data, size_t len,
+                          prg_segment_t *segs) {
+    size_t pos = 2;
+    long n = 0;
+
+    while (pos < len) {
+        if (len - pos >= 2 && data[pos] == 0xFF && data[pos + 1] == 0xFF) {
+            pos += 2;
+            continue;
+        }
+        if (len - pos < 4) {
+            return fail(EINVAL);
+        }
+
+        uint16_t start = word(&data[pos]), end = word(&data[pos + 2]);
+        uint32_t size = (uint32_t)end - start + 1;
+        pos += 4;
+        if (end < start || len - pos < size) {
+            return fail(EINVAL);
+        }
+
+        if (segs) {
+            segs[n].start = start;
+            segs[n].size = size;
+            segs[n].data = &data[pos];
+        }
+        n++;
+        pos += size;
+    }
+
+    return (n ? n : fail(EINVAL));
+}
+
+/* the segments point into data, which has to stay around */
+int prg_parse(prg_image_t *img, const uint8_t *data, size_t len) {
+    memset(img, 0, sizeof *img);
+
+    if (len == SNAPSHOT_HEADER + MEM_MAX + 1 &&
+        memcmp(data, snapshot_magic, sizeof snapshot_magic) == 0) {
+        if (data[4] != SNAPSHOT_VERSION) {
+            return fail(EINVAL);
+        }
+
+        img->format = PRG_SNAPSHOT;
+        img->a = data[5];
+        img->x = data[6];
+        img->y = data[7];
+        img->ps = data[8];
+        img->sp = data[9];
+        img->pc = word(&data[10]);
+        img->segments = malloc(sizeof *img->segments);
+        img->segments[0].start = 0;
+        img->segments[0].size = MEM_MAX + 1;
+        img->segments[0].data = &data[SNAPSHOT_HEADER];
+        img->num_segments = 1;
+        return 0;
+    }
+
+    /* a .prg loading one byte at $FFFF starts the same way */
+    if (len > 2 && word(data) == 0xFFFF) {
+        long n = find_segments(data, len, NULL);
+        if (n > 0) {
+            img->format = PRG_SEGMENTS;
+            img->segments = malloc(n * sizeof *img->segments);
+            img->num_segments = find_segments(data, len, img->segments);
+            return 0;
+        }
+    }
+
+    if (len < 2) {
+        return fail(EINVAL);
+    }
+    if (word(data) + (len - 2) > MEM_MAX + 1) {
+        /* broken segments rather than a .prg that's too big */
+        return fail(word(data) == 0xFFFF ? EINVAL : EFBIG);
+    }
+
+    img->format = PRG_PLAIN;
+    img->segments = malloc(sizeof *img->segments);
+    img->segments[0].start = word(data);
+    img->segments[0].size = len - 2;
+    img->segments[0].data = &data[2];
+    img->num_segments = 1;
+    return 0;
+}
+
+/* the segments were checked to fit by prg_parse */
+void prg_apply(const prg_image_t *img, cpu_state_t *cpu) {
+    size_t i;
+    for (i = 0; i < img->num_segments; ++i) {
+        const prg_segment_t *seg = &img->segments[i];
+        memcpy(&cpu->mem[seg->start], seg->data, seg->size);
+    }
+
+    if (img->format == PRG_SNAPSHOT) {
+        cpu->a = img->a;
+        cpu->x = img->x;
+        cpu->y = img->y;
+        cpu->ps = img->ps;
+        cpu->sp = img->sp;
+        cpu->pc = img->pc;
+    }
+}
+
+void prg_free(prg_image_t *img) {
+    free(img->segments);
+    memset(img, 0, sizeof *img);
+}
+
+/* all of fd into a buffer of its own, NULL if reading fails */
+static uint8_t *read_all(int fd, size_t *len) {
+    size_t cap = READ_CHUNK;
+    uint8_t *buf = malloc(cap);
+    ssize_t n;
+
+    *len = 0;
+    for (;;) {
+        if (*len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+
+        n = read(fd, buf + *len, cap - *len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) {
+            return buf;
+        }
+        *len += n;
+    }
+}
 
 int load_prg(cpu_state_t *cpu, const char *filename) {
-    uint8_t buf[2];
+    return load_prg_range(cpu, filename, NULL, NULL);
+}
 
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
+int load_prg_range(cpu_state_t *cpu, const char *filename, uint16_t *start,
+                   uint32_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
         return -1;
     }
 
-    size_t n;
-    n = fread(buf, 1, 2, f);
-    if (n != 2) {
-        fclose(f);
+    struct stat st;
+    void *map = MAP_FAILED;
+    uint8_t *buf = NULL;
+    const uint8_t *data;
+    size_t len;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        data = map;
+        len = st.st_size;
+    }
+    else if ((data = buf = read_all(fd, &len)) == NULL) {
+        int err = errno;
+        close(fd);
+        return fail(err);
+    }
+    close(fd);
+
+    prg_image_t img;
+    int ret = prg_parse(&img, data, len);
+    int err = errno;
+    if (ret == 0) {
+        prg_apply(&img, cpu);
+        if (start) {
+            *start = img.segments[0].start;
+        }
+        if (size) {
+            *size = img.segments[0].size;
+        }
+        prg_free(&img);
+    }
+
+    if (map != MAP_FAILED) {
+        munmap(map, len);
+    }
+    free(buf);
+    return (ret == 0 ? 0 : fail(err));
+}
+
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+static int same_file(const cached_t *c, const struct stat *st) {
+    return (c->dev == st->st_dev && c->ino == st->st_ino &&
+            c->size == st->st_size &&
+            c->mtime.tv_sec == st->st_mtim.tv_sec &&
+            c->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void free_cached(cached_t *c) {
+    prg_free(&c->image);
+    free(c->data);
+    free(c->path);
+    free(c);
+}
+
+int load_prg_cached(cpu_state_t *cpu, const char *filename) {
+    cached_t **slot = &buckets[hash_path(filename) % CACHE_BUCKETS];
+    cached_t *c;
+    struct stat st;
+
+    if (stat(filename, &st) != 0) {
         return -1;
     }
-    uint16_t load_address = buf[0] | (buf[1]<<8);
 
-    n = 1;
-    while (n == 1) {
-        uint8_t c;
-        n = fread(&c, 1, 1, f);
-        if (n == 1) {
-            cpu->mem[load_address++] = c;
+    for (; (c = *slot) != NULL; slot = &c->next) {
+        if (strcmp(c->path, filename) != 0) {
+            continue;
+        }
+        if (same_file(c, &st)) {
+            prg_apply(&c->image, cpu);
+            return 0;
         }
+
+        /* it changed, read it again */
+        *slot = c->next;
+        free_cached(c);
+        break;
     }
-    fclose(f);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* what's read is what gets checked against later */
+    uint8_t *data = NULL;
+    size_t len;
+    if (fstat(fd, &st) != 0 || (data = read_all(fd, &len)) == NULL) {
+        int err = errno;
+        close(fd);
+        return fail(err);
+    }
+    close(fd);
+
+    prg_image_t img;
+    if (prg_parse(&img, data, len) != 0) {
+        int err = errno;
+        free(data);
+        return fail(err);
+    }
+
+    c = malloc(sizeof *c);
+    c->path = strdup(filename);
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    c->size = st.st_size;
+    c->mtime = st.st_mtim;
+    c->data = data;
+    c->image = img;
+    c->next = *slot;
+    *slot = c;
+
+    prg_apply(&c->image, cpu);
     return 0;
 }
 
+void prg_cache_clear(void) {
+    size_t i;
+    for (i = 0; i < CACHE_BUCKETS; ++i) {
+        while (buckets[i]) {
+            cached_t *next = buckets[i]->next;
+            free_cached(buckets[i]);
+            buckets[i] = next;
+        }
+    }
+}
+
+int save_prg(cpu_state_t *cpu, const char *filename, uint16_t start,
+             uint32_t size) {
+    uint8_t buf[2] = {start & 0xFF, start >> 8};
+
+    if (start + size > MEM_MAX + 1) {
+        return -1;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fwrite(buf, 1, 2, f) != 2 ||
+        fwrite(&cpu->mem[start], 1, size, f) != size) {
+        fclose(f);
+        return -1;
+    }
+    return (fclose(f) == 0 ? 0 : -1);
+}
+
+int save_snapshot(const cpu_state_t *cpu, const char *filename) {
+    uint8_t header[SNAPSHOT_HEADER] = {
+        snapshot_magic[0], snapshot_magic[1], snapshot_magic[2],
+        snapshot_magic[3], SNAPSHOT_VERSION,
+        cpu->a, cpu->x, cpu->y, cpu->ps, cpu->sp,
+        cpu->pc & 0xFF, cpu->pc >> 8
+    };
+
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fwrite(header, 1, sizeof header, f) != sizeof header ||
+        fwrite(cpu->mem, 1, MEM_MAX + 1, f) != MEM_MAX + 1) {
+        fclose(f);
+        return -1;
+    }
+    return (fclose(f) == 0 ? 0 : -1);
+}
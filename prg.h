@@ -1,4 +1,61 @@
+#ifndef P64_PRG_H
+#define P64_PRG_H
+
+/*
+ * Memory images in and out of files.
+ *
+ * Three formats are read, told apart by how they start:
+ *   .prg       the load address (little endian) and the bytes to put there
+ *   segments   $FF $FF, then segments of a start and an inclusive end
+ *              address (little endian) followed by their bytes. $FF $FF
+ *              may come again before any segment
+ *   snapshot   "P64" $1A, version 1, a x y ps sp, pc (little endian) and
+ *              all of memory, as written by save_snapshot
+ * An image that would go past $FFFF is refused with EFBIG, a malformed
+ * one with EINVAL, and memory is left alone. Files are mapped and every
+ * segment goes in with one memcpy.
+ *
+ * load_prg_cached keeps what it parsed by path, so loading the same file
+ * into fresh instances costs a stat and the copies. A file that changed
+ * size, mtime or inode is read again. The cache isn't thread safe.
+ *
+ * Many states in one compact file, for checkpoints, are in state.h.
+ */
+
+#include <stddef.h>
 #include "6502.h"
 
+#define PRG_PLAIN     0
+#define PRG_SEGMENTS  1
+#define PRG_SNAPSHOT  2
+
+typedef struct prg_segment {
+    uint16_t start;
+    uint32_t size;
+    const uint8_t *data;        /* into what was parsed */
+} prg_segment_t;
+
+typedef struct prg_image {
+    int format;
+    prg_segment_t *segments;
+    size_t num_segments;
+    uint8_t a, x, y, ps, sp;    /* with PRG_SNAPSHOT */
+    uint16_t pc;
+} prg_image_t;
+
+int prg_parse(prg_image_t *, const uint8_t *data, size_t len);
+void prg_apply(const prg_image_t *, cpu_state_t *);
+void prg_free(prg_image_t *);
+
 int load_prg(cpu_state_t *cpu, const char *filename);
+/* start and size get where the first segment went unless NULL */
+int load_prg_range(cpu_state_t *cpu, const char *filename, uint16_t *start,
+                   uint32_t *size);
+int load_prg_cached(cpu_state_t *cpu, const char *filename);
+void prg_cache_clear(void);
+
+int save_prg(cpu_state_t *cpu, const char *filename, uint16_t start,
+             uint32_t size);
+int save_snapshot(const cpu_state_t *cpu, const char *filename);
 
+#endif /* !P64_PRG_H */
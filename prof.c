@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 199309L
+#include "prof.h"
+#include "6502.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define NUM_BUCKETS 32  /* log2(ticks) */
+
+typedef struct opc_prof {
+  uint64_t count;
+  uint64_t total;
+  uint64_t min, max;
+  uint64_t buckets[NUM_BUCKETS];
+} opc_prof_t;
+
+static opc_prof_t profile[0x100];
+static uint64_t overhead;              /* cost of a bare prof_now pair */
+static uint64_t start_ticks, start_ns;
+static int started;
+
+static void prof_report(void);
+
+static const char *mode_names[ADR_MAX] = {
+  "imp", "imm", "zp", "zp,x", "zp,y", "abs", "abs,x", "abs,y",
+  "(zp,x)", "(zp),y", "(abs)", "rel"
+};
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t prof_now(void) {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return mono_ns();
+#endif
+}
+
+static void prof_start(void) {
+  /* the smallest delta between two back-to-back reads is what the timer
+   * itself costs; it's subtracted from every sample */
+  uint64_t best = (uint64_t)-1;
+  int i;
+  for (i = 0; i < 1000; ++i) {
+    uint64_t t0 = prof_now();
+    uint64_t d = prof_now() - t0;
+    if (d < best)
+      best = d;
+  }
+
+  overhead = best;
+  start_ticks = prof_now();
+  start_ns = mono_ns();
+  started = 1;
+  atexit(prof_report);
+}
+
+void prof_record(uint8_t opcode, uint64_t ticks) {
+  if (!started)
+    prof_start();
+
+  opc_prof_t *p = &profile[opcode];
+  ticks = (ticks > overhead ? ticks - overhead : 0);
+
+  int b = 0;
+  while (b < NUM_BUCKETS - 1 && (ticks >> (b + 1)))
+    b++;
+
+  if (!p->count || ticks < p->min) p->min = ticks;
+  if (ticks > p->max) p->max = ticks;
+  p->count++;
+  p->total += ticks;
+  p->buckets[b]++;
+}
+
+/* upper bound of the bucket holding the given fraction of the samples */
+static uint64_t prof_quantile(const opc_prof_t *p, double q) {
+  uint64_t want = (uint64_t)(p->count * q);
+  uint64_t seen = 0;
+  int b;
+  for (b = 0; b < NUM_BUCKETS; ++b) {
+    seen += p->buckets[b];
+    if (seen > want)
+      break;
+  }
+
+  uint64_t bound = (uint64_t)1 << (b + 1);
+  return (bound < p->max ? bound : p->max);
+}
+
+static int cmp_total(const void *a, const void *b) {
+  uint64_t ta = profile[*(const uint8_t *)a].total;
+  uint64_t tb = profile[*(const uint8_t *)b].total;
+  return (ta < tb) - (ta > tb);
+}
+
+static void prof_report(void) {
+  if (!started)
+    return;
+
+  /* tsc ticks are converted using the rate observed over the whole run */
+  uint64_t ticks = prof_now() - start_ticks;
+  uint64_t ns = mono_ns() - start_ns;
+  double ns_per_tick = (ticks ? (double)ns / ticks : 1.0);
+
+  uint8_t order[0x100];
+  uint64_t grand_total = 0, grand_count = 0;
+  size_t n = 0, i;
+
+  for (i = 0; i < 0x100; ++i) {
+    if (profile[i].count) {
+      order[n++] = i;
+      grand_total += profile[i].total;
+      grand_count += profile[i].count;
+    }
+  }
+
+  qsort(order, n, sizeof order[0], cmp_total);
+
+  fprintf(stderr,
+          "\nhost cost per opcode (%llu instructions, %.2f ns/tick)\n"
+          "opc  instr mode         count     total ns  avg ns  min ns  "
+          "p50 ns  p99 ns  max ns  share\n",
+          (unsigned long long)grand_count, ns_per_tick);
+
+  for (i = 0; i < n; ++i) {
+    const opc_prof_t *p = &profile[order[i]];
+    const opc_descr_t *descr = instr_descr(order[i]);
+
+    fprintf(stderr,
+            "$%02X  %-5s %-7s %10llu %12.0f %7.1f %7.1f %7.1f %7.1f %7.1f %5.1f%%\n",
+            order[i],
+            descr->name ? descr->name : "???",
+            descr->name ? mode_names[descr->addr_m] : "",
+            (unsigned long long)p->count,
+            p->total * ns_per_tick,
+            (double)p->total / p->count * ns_per_tick,
+            p->min * ns_per_tick,
+            prof_quantile(p, 0.50) * ns_per_tick,
+            prof_quantile(p, 0.99) * ns_per_tick,
+            p->max * ns_per_tick,
+            grand_total ? 100.0 * p->total / grand_total : 0.0);
+  }
+
+  /* the same numbers rolled up per addressing mode */
+  uint64_t mode_total[ADR_MAX] = {0}, mode_count[ADR_MAX] = {0};
+  for (i = 0; i < n; ++i) {
+    const opc_descr_t *descr = instr_descr(order[i]);
+    if (descr->name) {
+      mode_total[descr->addr_m] += profile[order[i]].total;
+      mode_count[descr->addr_m] += profile[order[i]].count;
+    }
+  }
+
+  fprintf(stderr, "\nmode          count     total ns  avg ns\n");
+  for (i = 0; i < ADR_MAX; ++i) {
+    if (mode_count[i])
+      fprintf(stderr, "%-7s %11llu %12.0f %7.1f\n",
+              mode_names[i],
+              (unsigned long long)mode_count[i],
+              mode_total[i] * ns_per_tick,
+              (double)mode_total[i] / mode_count[i] * ns_per_tick);
+  }
+}
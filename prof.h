@@ -0,0 +1,26 @@
+#ifndef P64_PROF_H
+#define P64_PROF_H
+
+/*
+ * Host-side cost instrumentation for the interpreter. Every executed
+ * instruction is timed with rdtsc (or CLOCK_MONOTONIC where there is no
+ * tsc) and binned per opcode. A report sorted by total host time is
+ * printed at exit.
+ *
+ * Only active when built with -DP64_PROFILE, see "./make.sh profile".
+ */
+
+#include <stdint.h>
+
+#ifdef P64_PROFILE
+#define PROF_BEGIN(t0)      uint64_t t0 = prof_now()
+#define PROF_END(t0, opc)   prof_record((opc), prof_now() - (t0))
+#else
+#define PROF_BEGIN(t0)
+#define PROF_END(t0, opc)
+#endif
+
+uint64_t prof_now(void);
+void prof_record(uint8_t opcode, uint64_t ticks);
+
+#endif /* !P64_PROF_H */
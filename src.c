@@ -0,0 +1,330 @@
+#include "src.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static src_line_t *line_at(src_t *s, size_t n) {
+  return &s->lines[s->order[n]];
+}
+
+src_line_t *src_line(src_t *s, size_t n) {
+  return (n < s->num_lines ? line_at(s, n) : NULL);
+}
+
+/* where line n goes, right after the one before it */
+uint16_t src_start(src_t *s, size_t n) {
+  if (n == 0)
+    return 0;
+
+  const src_line_t *prev = line_at(s, n - 1);
+  return prev->start + prev->len;
+}
+
+void src_init(src_t *s, struct cpu_state *cpu) {
+  memset(s, 0, sizeof *s);
+  s->cpu = cpu;
+}
+
+void src_free(src_t *s) {
+  size_t i;
+  for (i = 0; i < s->num_ids; ++i)
+    free(s->lines[i].text);
+
+  free(s->lines);
+  free(s->order);
+  free(s->users);
+  free(s->redo);
+  sym_clear(&s->sym);
+  memset(s, 0, sizeof *s);
+}
+
+static void add_user(src_t *s, uint32_t id) {
+  src_line_t *l = &s->lines[id];
+
+  if (s->sym.num_symbols > s->max_users) {
+    size_t max = s->sym.num_symbols * 2;
+    s->users = realloc(s->users, max * sizeof *s->users);
+    memset(&s->users[s->max_users], 0,
+           (max - s->max_users) * sizeof *s->users);
+    s->max_users = max;
+  }
+
+  l->prev_user = 0;
+  l->next_user = s->users[l->symbol];
+  if (l->next_user)
+    s->lines[l->next_user - 1].prev_user = id + 1;
+  s->users[l->symbol] = id + 1;
+}
+
+static void remove_user(src_t *s, uint32_t id) {
+  src_line_t *l = &s->lines[id];
+
+  if (l->prev_user)
+    s->lines[l->prev_user - 1].next_user = l->next_user;
+  else
+    s->users[l->symbol] = l->next_user;
+
+  if (l->next_user)
+    s->lines[l->next_user - 1].prev_user = l->prev_user;
+}
+
+static void add_redo(src_t *s, uint32_t id) {
+  if (s->num_redo == s->max_redo) {
+    s->max_redo = (s->max_redo ? s->max_redo * 2 : 16);
+    s->redo = realloc(s->redo, s->max_redo * sizeof *s->redo);
+  }
+
+  s->redo[s->num_redo++] = id;
+}
+
+/* writes the operand of the line for where its symbol is now */
+static void patch(src_t *s, src_line_t *l) {
+  uint8_t mode = instr_descr(l->op)->addr_m;
+  uint8_t *mem = s->cpu->mem;
+  uint16_t val = l->val;
+
+  if (!(l->flags & ASM_LINE_INSTR) || mode == ADR_IMP)
+    return;
+
+  if (l->flags & SRC_SYM) {
+    const sym_def_t *symdef = &s->sym.symbols[l->symbol];
+    if (symdef->flags & SYM_UNDEFINED) {
+      /* like the assembler leaves it */
+      memset(&mem[(uint16_t)(l->start + 1)], 0, l->len - 1);
+      return;
+    }
+
+    val = symdef->address;
+    if (l->len == 2 && mode != ADR_REL && val > 0xFF) {
+      add_redo(s, l - s->lines);
+      return;
+    }
+  }
+
+  s->patched++;
+  if (asm_patch(mem, l->start + 1, mode, val) != 0)
+    s->sym.num_errors++;
+}
+
+static void patch_users(src_t *s, uint32_t symbol) {
+  uint32_t user = (symbol < s->max_users ? s->users[symbol] : 0);
+  while (user) {
+    patch(s, &s->lines[user - 1]);
+    user = s->lines[user - 1].next_user;
+  }
+}
+
+/*
+ * Lays out the lines from n up to the next org right after the line before
+ * them, which moves their bytes if that line changed size. Their labels
+ * move along, so the lines using them are patched, as is every branch that
+ * moved as its target may not have.
+ */
+static void lay_out(src_t *s, size_t n) {
+  uint8_t *mem = s->cpu->mem;
+  size_t end, i;
+
+  if (n == s->num_lines || (line_at(s, n)->flags & ASM_LINE_ORG) ||
+      line_at(s, n)->start == src_start(s, n))
+    return;
+
+  for (end = n + 1; end < s->num_lines; ++end) {
+    if (line_at(s, end)->flags & ASM_LINE_ORG)
+      break;
+  }
+
+  uint16_t from = line_at(s, n)->start, to = src_start(s, n);
+  uint16_t delta = to - from;
+  uint32_t size = (uint16_t)(line_at(s, end - 1)->start +
+                             line_at(s, end - 1)->len - from);
+  uint8_t *code = malloc(size + 1);
+  uint32_t j;
+
+  for (j = 0; j < size; ++j) {
+    code[j] = mem[(uint16_t)(from + j)];
+    mem[(uint16_t)(from + j)] = 0;
+  }
+  for (j = 0; j < size; ++j)
+    mem[(uint16_t)(to + j)] = code[j];
+  free(code);
+
+  for (i = n; i < end; ++i) {
+    src_line_t *l = line_at(s, i);
+    l->start += delta;
+    if (l->flags & ASM_LINE_LABEL)
+      s->sym.symbols[l->label].address = l->start;
+  }
+
+  for (i = n; i < end; ++i) {
+    src_line_t *l = line_at(s, i);
+    if (l->flags & ASM_LINE_LABEL)
+      patch_users(s, l->label);
+    if ((l->flags & ASM_LINE_INSTR) &&
+        instr_descr(l->op)->addr_m == ADR_REL)
+      patch(s, l);
+  }
+
+  free(s->sym.by_address);
+  s->sym.by_address = NULL;
+}
+
+static char *copy_text(const char *text) {
+  size_t len = strlen(text);
+  char *copy = malloc(len + 1);
+  memcpy(copy, text, len + 1);
+  return copy;
+}
+
+/* assembles line n from text in place of what it was */
+static int assemble(src_t *s, size_t n, const char *text) {
+  uint32_t id = s->order[n];
+  src_line_t *l = &s->lines[id];
+  src_line_t old = *l;
+  uint8_t *mem = s->cpu->mem;
+  uint16_t start = src_start(s, n);
+  uint8_t saved[3], code[3];
+  asm_line_t info;
+  int i;
+
+  for (i = 0; i < 3; ++i)
+    saved[i] = mem[(uint16_t)(start + i)];
+
+  if (old.flags & SRC_SYM)
+    remove_user(s, id);
+  if (old.flags & ASM_LINE_LABEL)
+    sym_forget(&s->sym, &s->sym.symbols[old.label]);
+
+  s->cpu->pc = start;
+  s->assembled++;
+  if (asm_line(s->cpu, &s->sym, text, strlen(text), &info) != 0) {
+    for (i = 0; i < 3; ++i)
+      mem[(uint16_t)(start + i)] = saved[i];
+    if (info.flags & ASM_LINE_LABEL)
+      sym_forget(&s->sym, &s->sym.symbols[info.label]);
+    if (old.flags & ASM_LINE_LABEL)
+      s->sym.symbols[old.label].flags &= ~SYM_UNDEFINED;
+    if (old.flags & SRC_SYM)
+      add_user(s, id);
+    return -1;
+  }
+
+  /* the new bytes wait until the rest of the segment has moved */
+  uint8_t len = (info.flags & ASM_LINE_INSTR ? instr_len(info.instr.op) : 0);
+  for (i = 0; i < 3; ++i) {
+    code[i] = mem[(uint16_t)(start + i)];
+    mem[(uint16_t)(start + i)] = saved[i];
+  }
+
+  free(l->text);
+  l->text = copy_text(text);
+  l->flags = info.flags;
+  l->start = (info.flags & ASM_LINE_ORG ? s->cpu->pc : start);
+  l->len = len;
+  l->label = info.label;
+  l->op = info.instr.op;
+  l->symbol = info.instr.symbol;
+  if (info.instr.flags & ASM_INSTR_SYM)
+    l->flags |= SRC_SYM;
+
+  if (len == 3)
+    l->val = code[1] << 8 | code[2];
+  else if (len == 2 && instr_descr(l->op)->addr_m == ADR_REL)
+    l->val = start + 2 + (int8_t)code[1];
+  else if (len == 2)
+    l->val = code[1];
+
+  for (i = 0; i < old.len; ++i)
+    mem[(uint16_t)(old.start + i)] = 0;
+  lay_out(s, n + 1);
+  for (i = 0; i < len; ++i)
+    mem[(uint16_t)(start + i)] = code[i];
+
+  if (l->flags & SRC_SYM) {
+    add_user(s, id);
+    patch(s, l);
+  }
+
+  /* users of a label that went away get zeros, like when it was missing */
+  int same_label = ((old.flags & l->flags & ASM_LINE_LABEL) &&
+                    old.label == l->label && old.start == l->start);
+  if ((old.flags & ASM_LINE_LABEL) && !same_label)
+    patch_users(s, old.label);
+  if ((l->flags & ASM_LINE_LABEL) && !same_label)
+    patch_users(s, l->label);
+
+  return 0;
+}
+
+/* the lines whose operand outgrew the zero page */
+static void redo_lines(src_t *s) {
+  while (s->num_redo) {
+    src_line_t *l = &s->lines[s->redo[--s->num_redo]];
+    char *text = copy_text(l->text);
+    assemble(s, l->index, text);
+    free(text);
+  }
+}
+
+int src_edit(src_t *s, size_t n, const char *text) {
+  if (n >= s->num_lines)
+    return -1;
+
+  int ret = assemble(s, n, text);
+  redo_lines(s);
+  return ret;
+}
+
+static void renumber(src_t *s, size_t n) {
+  for (; n < s->num_lines; ++n)
+    line_at(s, n)->index = n;
+}
+
+int src_insert(src_t *s, size_t n, const char *text) {
+  if (n > s->num_lines)
+    n = s->num_lines;
+
+  if (s->num_ids == s->max_ids) {
+    s->max_ids = (s->max_ids ? s->max_ids * 2 : 256);
+    s->lines = realloc(s->lines, s->max_ids * sizeof *s->lines);
+  }
+  if (s->num_lines == s->max_lines) {
+    s->max_lines = (s->max_lines ? s->max_lines * 2 : 256);
+    s->order = realloc(s->order, s->max_lines * sizeof *s->order);
+  }
+
+  /* an empty line first, it doesn't move anything */
+  uint32_t id = s->num_ids++;
+  memset(&s->lines[id], 0, sizeof s->lines[id]);
+  s->lines[id].text = copy_text("");
+  memmove(&s->order[n + 1], &s->order[n],
+          (s->num_lines - n) * sizeof *s->order);
+  s->order[n] = id;
+  s->num_lines++;
+  s->lines[id].start = src_start(s, n);
+  renumber(s, n);
+
+  if (src_edit(s, n, text) != 0) {
+    src_delete(s, n);
+    return -1;
+  }
+
+  return 0;
+}
+
+void src_delete(src_t *s, size_t n) {
+  if (n >= s->num_lines)
+    return;
+
+  /* once it's empty it takes no room */
+  assemble(s, n, "");
+  redo_lines(s);
+
+  src_line_t *l = line_at(s, n);
+  free(l->text);
+  l->text = NULL;
+  memmove(&s->order[n], &s->order[n + 1],
+          (s->num_lines - n - 1) * sizeof *s->order);
+  s->num_lines--;
+  renumber(s, n);
+}
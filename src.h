@@ -0,0 +1,66 @@
+#ifndef P64_SRC_H
+#define P64_SRC_H
+
+/*
+ * A program kept as source lines, for editing it while it's in memory.
+ *
+ * Every line remembers where it went, the label it defines and the symbol
+ * its operand uses, and every symbol has a list of the lines using it.
+ * Changing a line assembles only that line. If its size changes, the rest
+ * of its segment (up to the next org) is moved, and the lines using a
+ * label that moved or branching out of the moved code get their operand
+ * patched. A line is only assembled again when its operand stops fitting,
+ * like a zero page label that ended up above $FF.
+ *
+ * Lines are numbered from 0 in program order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "6502.h"
+#include "asm.h"
+
+#define SRC_SYM 0x08        /* line flag next to ASM_LINE_*, uses symbol */
+
+typedef struct src_line {
+  char *text;
+  uint32_t index;           /* in the program */
+  uint16_t start;           /* where an org moved the pc to */
+  uint8_t len;              /* bytes it emitted */
+  uint8_t flags;
+  uint8_t op;
+  uint16_t val;             /* the operand without a symbol, for branches
+                             * the target */
+  uint32_t label;           /* with ASM_LINE_LABEL */
+  uint32_t symbol;          /* with SRC_SYM */
+  uint32_t next_user;       /* lines using the same symbol, id + 1 */
+  uint32_t prev_user;
+} src_line_t;
+
+typedef struct src {
+  struct cpu_state *cpu;
+  symtab_t sym;
+  src_line_t *lines;        /* by id, which don't change */
+  size_t num_ids, max_ids;
+  uint32_t *order;          /* ids in program order */
+  size_t num_lines, max_lines;
+  uint32_t *users;          /* by symbol, the first line using it, id + 1 */
+  size_t max_users;
+  uint32_t *redo;           /* ids of lines to assemble again */
+  size_t num_redo, max_redo;
+  size_t assembled, patched;  /* lines, for the caller to look at */
+} src_t;
+
+void src_init(src_t *, struct cpu_state *);
+void src_free(src_t *);
+
+/* these return -1 if the line doesn't assemble, the program is then left
+ * as it was */
+int src_insert(src_t *, size_t n, const char *text);
+int src_edit(src_t *, size_t n, const char *text);
+void src_delete(src_t *, size_t n);
+
+src_line_t *src_line(src_t *, size_t n);
+uint16_t src_start(src_t *, size_t n);
+
+#endif /* !P64_SRC_H */
@@ -0,0 +1,537 @@
+#define _POSIX_C_SOURCE 200809L
+#include "state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEADER_SIZE   8
+#define TRAILER_SIZE  32
+#define BITMAP_SIZE   (STATE_NUM_PAGES / 8)
+#define RECORD_SIZE   (8 + BITMAP_SIZE)    /* without the page numbers */
+#define NO_PAGE       UINT32_MAX
+#define WRITE_BUFFER  (1 << 20)
+
+/* literals are 0nnnnnnn and n + 1 bytes, matches 1nnnnnnn and a byte of
+ * distance - 1, copying n + 3 bytes from that far back */
+#define LZ_MAX_LIT    128
+#define LZ_MIN_MATCH  3
+#define LZ_MAX_MATCH  (0x7F + LZ_MIN_MATCH)
+#define LZ_HASH_BITS  8
+#define LZ_WORTH_IT   (STATE_PAGE_SIZE * 7 / 8)
+
+static const uint8_t magic[4] = {'P', '6', '4', 'S'};
+static const uint8_t end_magic[8] = {'P', '6', '4', 'S', 0x1A, 'E', 'N', 'D'};
+
+typedef struct page_slot {
+  uint64_t hash;
+  uint32_t page;              /* page number + 1, 0 when free */
+} page_slot_t;
+
+struct state_writer {
+  FILE *f;
+  char *buf;
+  uint64_t offset;
+  uint64_t flushed;           /* what pread can see of the file */
+  int failed;
+  uint64_t *page_offsets;     /* by page number */
+  size_t num_pages, max_pages;
+  page_slot_t *slots;
+  size_t num_slots;           /* a power of 2 */
+  uint64_t *state_offsets;
+  size_t num_states, max_states;
+  uint32_t prev_pages[STATE_NUM_PAGES];
+  uint8_t prev[MEM_MAX + 1];  /* the last state appended */
+};
+
+struct state_file {
+  uint8_t *map;
+  size_t size;
+  const uint8_t *page_index, *state_index;
+  size_t num_pages, num_states;
+  uint32_t cached[STATE_NUM_PAGES];   /* page number + 1, 0 if none */
+  uint8_t *cache;                     /* what it decoded to */
+};
+
+static int fail(int err) {
+  errno = err;
+  return -1;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+  while (n--) {
+    *p++ = v & 0xFF;
+    v >>= 8;
+  }
+}
+
+static uint64_t get_le(const uint8_t *p, int n) {
+  uint64_t v = 0;
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+static int is_zero(const uint8_t *page) {
+  uint64_t any = 0, w;
+  int i;
+  for (i = 0; i < STATE_PAGE_SIZE; i += 8) {
+    memcpy(&w, &page[i], 8);
+    any |= w;
+  }
+  return !any;
+}
+
+static uint64_t hash_page(const uint8_t *page) {
+  uint64_t hash = 0x9E3779B97F4A7C15u, w;
+  int i;
+  for (i = 0; i < STATE_PAGE_SIZE; i += 8) {
+    memcpy(&w, &page[i], 8);
+    hash = (hash ^ w) * 0xFF51AFD7ED558CCDu;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+static size_t lz_literals(uint8_t *out, const uint8_t *in, size_t n) {
+  size_t len = 0;
+  while (n) {
+    size_t run = (n < LZ_MAX_LIT ? n : LZ_MAX_LIT);
+    out[len++] = run - 1;
+    memcpy(&out[len], in, run);
+    len += run;
+    in += run;
+    n -= run;
+  }
+  return len;
+}
+
+/* greedy, with the last place each 3 bytes were seen. out needs room for
+ * a page and a control byte per LZ_MAX_LIT of it */
+static size_t lz_pack(const uint8_t *in, uint8_t *out) {
+  int16_t last[1 << LZ_HASH_BITS];
+  size_t pos = 0, lit = 0, len = 0;
+
+  memset(last, 0xFF, sizeof last);
+  while (pos + LZ_MIN_MATCH <= STATE_PAGE_SIZE) {
+    unsigned h = ((in[pos] << 16 | in[pos + 1] << 8 | in[pos + 2]) *
+                  2654435761u) >> (32 - LZ_HASH_BITS);
+    int from = last[h];
+    size_t n = 0;
+
+    last[h] = pos;
+    if (from >= 0) {
+      while (pos + n < STATE_PAGE_SIZE && n < LZ_MAX_MATCH &&
+             in[from + n] == in[pos + n])
+        ++n;
+    }
+    if (n < LZ_MIN_MATCH) {
+      ++pos;
+      continue;
+    }
+
+    len += lz_literals(&out[len], &in[lit], pos - lit);
+    out[len++] = 0x80 | (n - LZ_MIN_MATCH);
+    out[len++] = pos - from - 1;
+    pos += n;
+    lit = pos;
+  }
+
+  return len + lz_literals(&out[len], &in[lit], STATE_PAGE_SIZE - lit);
+}
+
+/* copies of 16 whole bytes where the page has room for them, short runs
+ * are the most common. what they write past the run is written again by
+ * what comes after it */
+static int lz_unpack(const uint8_t *in, size_t len, uint8_t *out) {
+  size_t pos = 0, i = 0, n, k;
+
+  while (i < len) {
+    uint8_t c = in[i++];
+    if (c < 0x80) {
+      n = c + 1;
+      if (n > len - i || n > STATE_PAGE_SIZE - pos)
+        return -1;
+      if (n <= 16 && len - i >= 16 && STATE_PAGE_SIZE - pos >= 16)
+        memcpy(&out[pos], &in[i], 16);
+      else
+        memcpy(&out[pos], &in[i], n);
+      i += n;
+    }
+    else {
+      n = (c & 0x7F) + LZ_MIN_MATCH;
+      if (i == len || n > STATE_PAGE_SIZE - pos || in[i] >= pos)
+        return -1;
+
+      /* overlapping, a distance of 1 repeats a byte */
+      size_t dist = in[i++] + 1;
+      const uint8_t *from = &out[pos - dist];
+      k = 0;
+      if (dist >= 16) {
+        for (; k < n && STATE_PAGE_SIZE - pos - k >= 16; k += 16)
+          memcpy(&out[pos + k], &from[k], 16);
+      }
+      for (; k < n; ++k)
+        out[pos + k] = from[k];
+    }
+    pos += n;
+  }
+
+  return (pos == STATE_PAGE_SIZE ? 0 : -1);
+}
+
+static void put(state_writer_t *w, const void *data, size_t n) {
+  if (fwrite(data, 1, n, w->f) != n)
+    w->failed = 1;
+  w->offset += n;
+}
+
+state_writer_t *state_create(const char *path) {
+  uint8_t header[HEADER_SIZE] = {
+    magic[0], magic[1], magic[2], magic[3], STATE_VERSION
+  };
+
+  FILE *f = fopen(path, "w+b");
+  if (!f)
+    return NULL;
+
+  state_writer_t *w = calloc(1, sizeof *w);
+  w->f = f;
+  w->buf = malloc(WRITE_BUFFER);
+  setvbuf(f, w->buf, _IOFBF, WRITE_BUFFER);
+  w->num_slots = 1024;
+  w->slots = calloc(w->num_slots, sizeof *w->slots);
+  put(w, header, sizeof header);
+  return w;
+}
+
+static void grow_slots(state_writer_t *w) {
+  size_t num_slots = w->num_slots * 2, i;
+  page_slot_t *slots = calloc(num_slots, sizeof *slots);
+
+  for (i = 0; i < w->num_slots; ++i) {
+    if (!w->slots[i].page)
+      continue;
+
+    size_t slot = w->slots[i].hash & (num_slots - 1);
+    while (slots[slot].page)
+      slot = (slot + 1) & (num_slots - 1);
+    slots[slot] = w->slots[i];
+  }
+
+  free(w->slots);
+  w->slots = slots;
+  w->num_slots = num_slots;
+}
+
+/* whether page n of the file holds these bytes. it's read back rather
+ * than kept, a match of the hash almost always is one */
+static int same_page(state_writer_t *w, uint32_t n, const uint8_t *page) {
+  uint8_t block[2 + STATE_PAGE_SIZE], out[STATE_PAGE_SIZE];
+  uint64_t offset = w->page_offsets[n];
+
+  if (offset + sizeof block > w->flushed) {
+    if (fflush(w->f) != 0) {
+      w->failed = 1;
+      return 0;
+    }
+    w->flushed = w->offset;
+  }
+
+  ssize_t got = pread(fileno(w->f), block, sizeof block, offset);
+  if (got < 2)
+    return 0;
+
+  size_t len = get_le(block, 2);
+  if (len > (size_t)got - 2)
+    return 0;
+  if (len == STATE_PAGE_SIZE)
+    return memcmp(&block[2], page, STATE_PAGE_SIZE) == 0;
+  return (lz_unpack(&block[2], len, out) == 0 &&
+          memcmp(out, page, STATE_PAGE_SIZE) == 0);
+}
+
+/* the number of a page with the same bytes, written now if there's none */
+static uint32_t add_page(state_writer_t *w, const uint8_t *page) {
+  uint64_t hash = hash_page(page);
+  size_t slot = hash & (w->num_slots - 1);
+  page_slot_t *s;
+
+  for (; (s = &w->slots[slot])->page; slot = (slot + 1) & (w->num_slots - 1)) {
+    if (s->hash == hash && same_page(w, s->page - 1, page))
+      return s->page - 1;
+  }
+
+  if (w->num_pages == w->max_pages) {
+    w->max_pages = (w->max_pages ? w->max_pages * 2 : 256);
+    w->page_offsets = realloc(w->page_offsets,
+                              w->max_pages * sizeof *w->page_offsets);
+  }
+
+  uint32_t n = w->num_pages++;
+  s->hash = hash;
+  s->page = n + 1;
+  w->page_offsets[n] = w->offset;
+
+  /* decoding costs more than copying, a page that barely packs is stored
+   * as it is */
+  uint8_t block[2 + STATE_PAGE_SIZE + STATE_PAGE_SIZE / LZ_MAX_LIT];
+  size_t len = lz_pack(page, &block[2]);
+  if (len > LZ_WORTH_IT) {
+    len = STATE_PAGE_SIZE;
+    memcpy(&block[2], page, len);
+  }
+  put_le(block, len, 2);
+  put(w, block, 2 + len);
+
+  if (w->num_pages * 2 > w->num_slots)
+    grow_slots(w);
+  return n;
+}
+
+/* a page that's the same as in the last state isn't looked up again */
+long state_append(state_writer_t *w, const cpu_state_t *cpu) {
+  uint8_t record[RECORD_SIZE + 4 * STATE_NUM_PAGES] = {
+    cpu->a, cpu->x, cpu->y, cpu->ps, cpu->sp, cpu->pc & 0xFF, cpu->pc >> 8
+  };
+  size_t len = RECORD_SIZE;
+  int p;
+
+  for (p = 0; p < STATE_NUM_PAGES; ++p) {
+    const uint8_t *page = &cpu->mem[p * STATE_PAGE_SIZE];
+    uint8_t *prev = &w->prev[p * STATE_PAGE_SIZE];
+
+    if (!w->num_states || memcmp(page, prev, STATE_PAGE_SIZE) != 0) {
+      w->prev_pages[p] = (is_zero(page) ? NO_PAGE : add_page(w, page));
+      memcpy(prev, page, STATE_PAGE_SIZE);
+    }
+    if (w->prev_pages[p] != NO_PAGE) {
+      record[8 + p / 8] |= 1 << p % 8;
+      put_le(&record[len], w->prev_pages[p], 4);
+      len += 4;
+    }
+  }
+
+  if (w->num_states == w->max_states) {
+    w->max_states = (w->max_states ? w->max_states * 2 : 256);
+    w->state_offsets = realloc(w->state_offsets,
+                               w->max_states * sizeof *w->state_offsets);
+  }
+  w->state_offsets[w->num_states] = w->offset;
+  put(w, record, len);
+
+  return (w->failed ? -1 : (long)w->num_states++);
+}
+
+int state_finish(state_writer_t *w) {
+  uint8_t trailer[TRAILER_SIZE], word[8];
+  size_t i;
+
+  put_le(trailer, w->offset, 8);
+  put_le(&trailer[8], w->num_pages, 8);
+  put_le(&trailer[16], w->num_states, 8);
+  memcpy(&trailer[24], end_magic, sizeof end_magic);
+
+  for (i = 0; i < w->num_pages; ++i) {
+    put_le(word, w->page_offsets[i], 8);
+    put(w, word, 8);
+  }
+  for (i = 0; i < w->num_states; ++i) {
+    put_le(word, w->state_offsets[i], 8);
+    put(w, word, 8);
+  }
+  put(w, trailer, sizeof trailer);
+
+  int ret = (fclose(w->f) == 0 && !w->failed ? 0 : -1);
+  free(w->buf);
+  free(w->page_offsets);
+  free(w->slots);
+  free(w->state_offsets);
+  free(w);
+  return ret;
+}
+
+state_file_t *state_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size < HEADER_SIZE + TRAILER_SIZE) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  size_t size = st.st_size;
+  const uint8_t *trailer = &map[size - TRAILER_SIZE];
+  uint64_t index = get_le(trailer, 8);
+  uint64_t num_pages = get_le(&trailer[8], 8);
+  uint64_t num_states = get_le(&trailer[16], 8);
+  size_t room = size - TRAILER_SIZE;
+
+  if (memcmp(map, magic, sizeof magic) != 0 || map[4] != STATE_VERSION ||
+      memcmp(&trailer[24], end_magic, sizeof end_magic) != 0 ||
+      index < HEADER_SIZE || index > room ||
+      num_pages > (room - index) / 8 ||
+      num_states != (room - index) / 8 - num_pages ||
+      (room - index) % 8) {
+    munmap(map, size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  state_file_t *s = calloc(1, sizeof *s);
+  s->map = map;
+  s->size = size;
+  s->page_index = &map[index];
+  s->state_index = &map[index + num_pages * 8];
+  s->num_pages = num_pages;
+  s->num_states = num_states;
+  return s;
+}
+
+void state_close(state_file_t *s) {
+  if (!s)
+    return;
+
+  munmap(s->map, s->size);
+  free(s->cache);
+  free(s);
+}
+
+size_t state_count(const state_file_t *s) {
+  return s->num_states;
+}
+
+/* page n at memory page p. what was last read for each memory page is
+ * kept, so a page that checkpoints have in common is decoded once */
+static int read_page(state_file_t *s, uint32_t n, uint8_t p, uint8_t *out) {
+  if (n >= s->num_pages)
+    return fail(EINVAL);
+
+  uint32_t *cached = &s->cached[p];
+  if (!s->cache)
+    s->cache = malloc(STATE_NUM_PAGES * STATE_PAGE_SIZE);
+  uint8_t *page = &s->cache[p * STATE_PAGE_SIZE];
+  if (*cached == n + 1) {
+    memcpy(out, page, STATE_PAGE_SIZE);
+    return 0;
+  }
+
+  uint64_t offset = get_le(&s->page_index[n * 8], 8);
+  if (offset > s->size - 2)
+    return fail(EINVAL);
+
+  size_t len = get_le(&s->map[offset], 2);
+  const uint8_t *data = &s->map[offset + 2];
+  if (len > s->size - offset - 2)
+    return fail(EINVAL);
+
+  if (len == STATE_PAGE_SIZE) {
+    memcpy(out, data, len);
+    return 0;
+  }
+  if (lz_unpack(data, len, page) != 0) {
+    *cached = 0;
+    return fail(EINVAL);
+  }
+
+  *cached = n + 1;
+  memcpy(out, page, STATE_PAGE_SIZE);
+  return 0;
+}
+
+/* the record of state i, NULL if it's damaged or there's none */
+static const uint8_t *find_state(const state_file_t *s, size_t i) {
+  if (i >= s->num_states) {
+    errno = ERANGE;
+    return NULL;
+  }
+
+  uint64_t offset = get_le(&s->state_index[i * 8], 8);
+  size_t num_pages = 0;
+  int b;
+
+  if (offset > s->size - RECORD_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const uint8_t *record = &s->map[offset];
+  for (b = 0; b < BITMAP_SIZE; ++b)
+    num_pages += __builtin_popcount(record[8 + b]);
+  if (num_pages * 4 > s->size - offset - RECORD_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return record;
+}
+
+/* memory is left in between if the file turns out to be damaged */
+int state_load(state_file_t *s, size_t i, cpu_state_t *cpu) {
+  const uint8_t *record = find_state(s, i), *pages;
+  int p;
+
+  if (!record)
+    return -1;
+
+  pages = &record[RECORD_SIZE];
+
+  for (p = 0; p < STATE_NUM_PAGES; ++p) {
+    uint8_t *page = &cpu->mem[p * STATE_PAGE_SIZE];
+
+    if (!(record[8 + p / 8] & (1 << p % 8))) {
+      memset(page, 0, STATE_PAGE_SIZE);
+    }
+    else {
+      if (read_page(s, get_le(pages, 4), p, page) != 0)
+        return -1;
+      pages += 4;
+    }
+  }
+
+  cpu->a = record[0];
+  cpu->x = record[1];
+  cpu->y = record[2];
+  cpu->ps = record[3];
+  cpu->sp = record[4];
+  cpu->pc = get_le(&record[5], 2);
+  return 0;
+}
+
+/* the page numbers are in the order of the bits set before it */
+int state_read_page(state_file_t *s, size_t i, uint8_t page,
+                    uint8_t out[STATE_PAGE_SIZE]) {
+  const uint8_t *record = find_state(s, i);
+  size_t n = 0;
+  int b;
+
+  if (!record)
+    return -1;
+
+  if (!(record[8 + page / 8] & (1 << page % 8))) {
+    memset(out, 0, STATE_PAGE_SIZE);
+    return 0;
+  }
+
+  for (b = 0; b < page / 8; ++b)
+    n += __builtin_popcount(record[8 + b]);
+  n += __builtin_popcount(record[8 + page / 8] & ((1 << page % 8) - 1));
+
+  return read_page(s, get_le(&record[RECORD_SIZE + n * 4], 4), page, out);
+}
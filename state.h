@@ -0,0 +1,60 @@
+#ifndef P64_STATE_H
+#define P64_STATE_H
+
+/*
+ * Files of many machine states, for checkpoints.
+ *
+ * A state is its registers, a bitmap of the pages of memory that aren't
+ * all zeros and the number of each of those pages. A page is written
+ * once per file however many states have it, compressed with a small LZ
+ * coder or as it is when that doesn't help. Both are written as states
+ * are appended, and closing the writer adds an index of where every page
+ * and state is, so a reader can map the file and get at one page of one
+ * state without touching the rest.
+ *
+ * Layout, numbers are little endian:
+ *   "P64S", version 2 (1 is prg.h's snapshot), 3 zero bytes
+ *   pages      u16 length, then that many bytes (256 means stored as is)
+ *   states     a x y ps sp, pc, 0, 32 byte bitmap, u32 page per bit set
+ *   index      u64 offset of every page, then of every state
+ *   trailer    u64 index offset, u64 pages, u64 states, "P64S" $1A "END"
+ * A file whose writer didn't get to state_finish has no index and can't
+ * be opened.
+ *
+ * The writer keeps a hash and an offset for every distinct page it has
+ * written, 16 bytes or so, and reads a page back from the file to make
+ * sure a match of the hash is the same bytes. A reader keeps what it last
+ * decoded for each page of memory, so going through checkpoints that
+ * share most of it is mostly copying. Neither side is thread safe, but
+ * any number of readers can be open on a file.
+ */
+
+#include <stddef.h>
+#include "6502.h"
+
+#define STATE_VERSION    2
+#define STATE_PAGE_SIZE  256
+#define STATE_NUM_PAGES  ((MEM_MAX + 1) / STATE_PAGE_SIZE)
+
+typedef struct state_writer state_writer_t;
+typedef struct state_file state_file_t;
+
+/* NULL with errno set if the file can't be created */
+state_writer_t *state_create(const char *path);
+/* the number of the state, -1 if writing failed */
+long state_append(state_writer_t *, const cpu_state_t *);
+/* writes the index and frees the writer, -1 if anything failed */
+int state_finish(state_writer_t *);
+
+/* NULL with errno set if it can't be opened or isn't finished */
+state_file_t *state_open(const char *path);
+void state_close(state_file_t *);
+size_t state_count(const state_file_t *);
+
+/* -1 with errno set to EINVAL if the file is damaged, ERANGE if there's
+ * no such state */
+int state_load(state_file_t *, size_t i, cpu_state_t *);
+int state_read_page(state_file_t *, size_t i, uint8_t page,
+                    uint8_t out[STATE_PAGE_SIZE]);
+
+#endif /* !P64_STATE_H */
@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define STATS_WINDOW     10           /* samples in the ips window */
+#define STATS_SAMPLE_NS  100000000u   /* 100ms between samples */
+
+#define STORE(field, val) __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+#define LOAD(field)       __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+stats_t *p64_stats;
+
+/* writer-private state: the sliding window used for ips */
+static uint64_t window_ns[STATS_WINDOW];
+static uint64_t window_instr[STATS_WINDOW];
+static size_t window_pos, window_len;
+static char shm_name[64];
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* creates and maps the segment for this process, returns 0 on success */
+int stats_open(void) {
+  if (p64_stats)
+    return 0;
+
+  snprintf(shm_name, sizeof shm_name, STATS_SHM_PREFIX "%ld", (long)getpid());
+
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("shm_open");
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(stats_t)) == -1) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(shm_name);
+    return -1;
+  }
+
+  void *p = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(shm_name);
+    return -1;
+  }
+
+  stats_t *s = p;
+  s->pid = getpid();
+  s->size = sizeof(stats_t);
+  s->start_ns = s->update_ns = mono_ns();
+  s->version = STATS_VERSION;
+  /* readers ignore the segment until the magic shows up */
+  __atomic_store_n(&s->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+  p64_stats = s;
+  atexit(stats_close);
+  return 0;
+}
+
+void stats_close(void) {
+  if (!p64_stats)
+    return;
+
+  munmap(p64_stats, sizeof(stats_t));
+  shm_unlink(shm_name);
+  p64_stats = NULL;
+}
+
+/* called from the interpreter loop every STATS_FLUSH instructions */
+void stats_update(uint32_t instructions, uint32_t cycles) {
+  stats_t *s = p64_stats;
+  if (!s)
+    return;
+
+  /* only this process writes, so plain load + relaxed store is enough */
+  uint64_t total = LOAD(s->instructions) + instructions;
+  STORE(s->instructions, total);
+  STORE(s->cycles, LOAD(s->cycles) + cycles);
+
+  uint64_t now = mono_ns();
+  STORE(s->update_ns, now);
+
+  size_t last = (window_pos + STATS_WINDOW - 1) % STATS_WINDOW;
+  if (window_len && now - window_ns[last] < STATS_SAMPLE_NS)
+    return;
+
+  window_ns[window_pos] = now;
+  window_instr[window_pos] = total;
+  window_pos = (window_pos + 1) % STATS_WINDOW;
+  if (window_len < STATS_WINDOW)
+    window_len++;
+
+  size_t oldest = (window_len < STATS_WINDOW ? 0 : window_pos);
+  uint64_t dt = now - window_ns[oldest];
+  if (dt)
+    STORE(s->ips, (total - window_instr[oldest]) * 1000000000u / dt);
+}
+
+void stats_stop(int reason, const cpu_state_t *cpu) {
+  stats_t *s = p64_stats;
+  if (!s)
+    return;
+
+  if (reason >= 0 && reason < STATS_MAX_STOPS)
+    STORE(s->stops[reason], LOAD(s->stops[reason]) + 1);
+
+  /* cheap enough at a stop, far too slow for the hot loop */
+  uint64_t pages = 0;
+  size_t page, i;
+  for (page = 0; page <= MEM_MAX; page += 0x100) {
+    for (i = page; i < page + 0x100 && !cpu->mem[i]; ++i);
+    pages += (i != page + 0x100);
+  }
+
+  STORE(s->pages_in_use, pages);
+}
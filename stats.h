@@ -0,0 +1,45 @@
+#ifndef P64_STATS_H
+#define P64_STATS_H
+
+/*
+ * Live runtime counters, published in a POSIX shared memory segment named
+ * STATS_SHM_PREFIX<pid> so that p64stat can watch any number of running
+ * emulators without stopping them.
+ *
+ * The layout of stats_t is fixed; anything that changes the meaning or the
+ * offset of a field must bump STATS_VERSION. The writer only uses relaxed
+ * atomic stores, readers must tolerate counters being slightly out of sync
+ * with each other.
+ */
+
+#include <stdint.h>
+#include "6502.h"
+
+#define STATS_MAGIC      0x53343650  /* "P64S" */
+#define STATS_VERSION    1
+#define STATS_SHM_PREFIX "/p64-stats-"
+#define STATS_MAX_STOPS  8
+#define STATS_FLUSH      4096        /* instructions between updates */
+
+typedef struct stats {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t size;                     /* sizeof(stats_t) */
+  uint64_t start_ns;                 /* CLOCK_MONOTONIC */
+  uint64_t update_ns;                /* time of the last flush */
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t ips;                      /* over roughly the last second */
+  uint64_t pages_in_use;             /* non-zero pages at the last stop */
+  uint64_t stops[STATS_MAX_STOPS];   /* indexed by STOP_* */
+} stats_t;
+
+extern stats_t *p64_stats;
+
+int stats_open(void);
+void stats_close(void);
+void stats_update(uint32_t instructions, uint32_t cycles);
+void stats_stop(int reason, const cpu_state_t *cpu);
+
+#endif /* !P64_STATS_H */